@@ -0,0 +1,118 @@
+#!/usr/bin/env bash
+
+# Measure the request/response latency across the emulated BSS, alone and
+# behind bulk traffic, to quantify the head-of-line blocking in the relay path.
+#
+# Usage: scripts/bench-latency.sh [report JSON] [baseline JSON]
+#
+# With vw0 as the AP and vw1 ... vw3 as STAs, sockperf ping-pongs 64-byte
+# messages over TCP and UDP, at several message rates ("max" for as fast as
+# possible), between:
+#   sta-ap      vw1 <-> vw0
+#   sta-ap-sta  vw1 <-> vw2, relayed by the AP
+# Every case runs idle, then along with 4 bulk TCP flows from vw3 to the
+# destination of the transactions, through the same AP. It reports the 50th,
+# 99th and 99.9th percentiles of the round trip time.
+
+export ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+source $ROOT/scripts/common.sh
+
+report=${1:-$ROOT/bench-latency-report.json}
+baseline=${2:-$ROOT/bench-latency-baseline.json}
+nr_sta=3
+duration=${DURATION:-5}
+topologies=${TOPOLOGIES:-"sta-ap sta-ap-sta"}
+rates=${RATES:-"1000 10000 max"}
+
+tmp=$(mktemp -d)
+results=$tmp/results.jsonl
+
+bench_setup station=$((nr_sta + 1)) hostapd sockperf iperf3 python3
+
+function cleanup() {
+    sudo pkill -x sockperf > /dev/null
+    sudo pkill -x iperf3 > /dev/null
+    stop_bss $nr_sta
+    rm -rf $tmp
+}
+
+function run_case() {
+    local topo=$1 proto=$2 rate=$3 load=$4
+    local name=$topo/$proto/$rate/$load
+    local src=1 dst=0 args
+
+    if [ $topo = sta-ap-sta ]; then
+        dst=2
+    fi
+
+    args="-i 10.0.0.$((dst + 1)) -p 11111"
+    if [ $proto = tcp ]; then
+        args="$args --tcp"
+    fi
+
+    sudo ip netns exec ns$dst sockperf server $args > /dev/null &
+    if [ $load = bulk ]; then
+        sudo ip netns exec ns$dst iperf3 -s -1 -D -p 5201
+    fi
+    sleep 0.5
+
+    if [ $load = bulk ]; then
+        sudo ip netns exec ns3 iperf3 -c 10.0.0.$((dst + 1)) -p 5201 -P 4 \
+            -t $((duration + 2)) > /dev/null &
+        # let the bulk flows fill the queues first
+        sleep 1
+    fi
+
+    if [ $rate = max ]; then
+        args="$args --mps=max"
+    else
+        args="$args --mps=$rate"
+    fi
+    sudo ip netns exec ns$src sockperf ping-pong $args -m 64 -t $duration \
+        --full-rtt > $tmp/sockperf.txt 2>&1
+
+    sudo pkill -x sockperf > /dev/null
+    sudo pkill -x iperf3 > /dev/null
+    wait
+
+    python3 $ROOT/scripts/bench.py sockperf $name $tmp/sockperf.txt \
+        >> $results
+    if ! tail -n 1 $results | grep -q p99_us; then
+        echo "$name: sockperf failed"
+        return 1
+    fi
+    tail -n 1 $results
+}
+
+if [ $final_ret -eq 0 ]; then
+    # to avoid device or resource busy error
+    sleep 0.5
+
+    start_bss $nr_sta
+    if [ $? -ne 0 ]; then
+        final_ret=4
+    fi
+fi
+
+if [ $final_ret -eq 0 ]; then
+    echo
+    echo "================================================================================"
+    echo "Round trip latency: $topologies, $duration seconds per case"
+    echo "================================================================================"
+    for topo in $topologies; do
+        for proto in tcp udp; do
+            for rate in $rates; do
+                for load in idle bulk; do
+                    run_case $topo $proto $rate $load
+                    if [ $? -ne 0 ]; then
+                        final_ret=5
+                    fi
+                done
+            done
+        done
+    done
+fi
+
+bench_report $results $report $baseline
+cleanup
+bench_exit
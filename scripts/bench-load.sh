@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+
+# Measure how long loading and unloading vwifi take as the number of stations
+# grows, to drive and verify startup and teardown optimizations.
+#
+# Usage: scripts/bench-load.sh [report JSON] [baseline JSON]
+#
+# For each number of stations, insmod and rmmod are timed from userspace, and
+# the module breaks them down into phases: those of loading are read from
+# /sys/kernel/debug/vwifi/init_timings, those of unloading from the kernel
+# log, debugfs being gone by then.
+
+export ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+source $ROOT/scripts/common.sh
+
+report=${1:-$ROOT/bench-load-report.json}
+baseline=${2:-$ROOT/bench-load-baseline.json}
+stations=${STATIONS:-"10 100 1000 10000"}
+timings=/sys/kernel/debug/vwifi/init_timings
+
+tmp=$(mktemp -d)
+results=$tmp/results.jsonl
+
+bench_setup "" python3
+
+function cleanup() {
+    remove_kmod vwifi
+    rm -rf $tmp
+}
+
+function now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+function run_case() {
+    local nr=$1
+    local start load_ms unload_ms
+
+    remove_kmod vwifi
+    marker="vwifi load bench $nr $(date +%s)"
+    echo "$marker" | sudo tee /dev/kmsg > /dev/null
+
+    start=$(now_ms)
+    sudo insmod $ROOT/vwifi.ko station=$nr
+    if [ $? -ne 0 ]; then
+        echo "station=$nr: insmod failed"
+        return 1
+    fi
+    load_ms=$(($(now_ms) - start))
+    sudo cat $timings > $tmp/init
+
+    start=$(now_ms)
+    sudo rmmod vwifi
+    if [ $? -ne 0 ]; then
+        echo "station=$nr: rmmod failed"
+        return 1
+    fi
+    unload_ms=$(($(now_ms) - start))
+    sudo dmesg | sed -n "/$marker/,\$p" > $tmp/exit
+
+    python3 $ROOT/scripts/bench.py load station/$nr $load_ms $unload_ms \
+        $tmp/init $tmp/exit >> $results
+    tail -n 1 $results
+}
+
+if [ $final_ret -eq 0 ]; then
+    echo
+    echo "================================================================================"
+    echo "Load and unload time: $stations stations"
+    echo "================================================================================"
+    for nr in $stations; do
+        run_case $nr
+        if [ $? -ne 0 ]; then
+            final_ret=5
+            break
+        fi
+    done
+fi
+
+bench_report $results $report $baseline
+cleanup
+bench_exit
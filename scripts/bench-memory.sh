@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+
+# Measure the kernel memory taken per station, to size hosts by clients per GB
+# and demonstrate memory optimizations.
+#
+# Usage: scripts/bench-memory.sh [report JSON] [baseline JSON]
+#
+# vwifi is loaded with an increasing number of stations. For each count, the
+# drop of MemAvailable and the growth of Slab (from /proc/meminfo) across the
+# insertion are divided by the number of stations, along with the bytes vwifi
+# accounts for itself in /sys/kernel/debug/vwifi/memory. Nothing runs on the
+# interfaces, so this is the footprint of idle stations.
+
+export ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+source $ROOT/scripts/common.sh
+
+report=${1:-$ROOT/bench-memory-report.json}
+baseline=${2:-$ROOT/bench-memory-baseline.json}
+stations=${STATIONS:-"10 100 1000"}
+memory=/sys/kernel/debug/vwifi/memory
+
+tmp=$(mktemp -d)
+results=$tmp/results.jsonl
+
+bench_setup "" python3
+
+function cleanup() {
+    remove_kmod vwifi
+    rm -rf $tmp
+}
+
+# Settle the freed objects and caches, for comparable snapshots of meminfo
+function settle() {
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+    sleep 1
+}
+
+function run_case() {
+    local nr=$1
+
+    remove_kmod vwifi
+    settle
+    cat /proc/meminfo > $tmp/before
+
+    insert_kmod $ROOT/vwifi.ko station=$nr
+    if [ $? -ne 0 ]; then
+        echo "station=$nr: insmod failed"
+        return 1
+    fi
+    settle
+    cat /proc/meminfo > $tmp/after
+    sudo cat $memory > $tmp/memory
+
+    python3 $ROOT/scripts/bench.py memory station/$nr $nr $tmp/before \
+        $tmp/after $tmp/memory >> $results
+    if [ $? -ne 0 ]; then
+        echo "station=$nr: no memory counters"
+        return 1
+    fi
+    tail -n 1 $results
+}
+
+if [ $final_ret -eq 0 ]; then
+    echo
+    echo "================================================================================"
+    echo "Memory per station: $stations stations"
+    echo "================================================================================"
+    for nr in $stations; do
+        run_case $nr
+        if [ $? -ne 0 ]; then
+            final_ret=5
+            break
+        fi
+    done
+fi
+
+bench_report $results $report $baseline
+cleanup
+bench_exit
@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+
+"""Results of the vwifi benchmarks (scripts/bench*.sh).
+
+Every case of a benchmark gives a result, a JSON object holding its name and
+its metrics, printed on a line of its own by one of the commands below. The
+results are then gathered into a report, and compared with a baseline report
+of the same benchmark.
+
+    bench.py iperf3 <name> <pps> <cpu_pct> <iperf3 JSON>...
+    bench.py sockperf <name> <sockperf output>
+    bench.py memory <name> <stations> <meminfo before> <meminfo after>
+                    <vwifi debugfs memory>
+    bench.py load <name> <load_ms> <unload_ms> <init_timings> <kernel log>
+    bench.py report <results> <report> [<baseline>]
+
+The comparison fails if a metric is worse than in the baseline by more than
+BENCH_THRESHOLD percent (10 by default).
+"""
+
+import datetime
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+
+# Whether a higher value of the metric is better, for the comparison. The
+# other metrics are informative.
+METRICS = {
+    'gbps': True,
+    'pps': True,
+    'p50_us': False,
+    'p99_us': False,
+    'p999_us': False,
+    'bytes_per_sta': False,
+    'vwifi_per_sta': False,
+    'load_ms': False,
+    'unload_ms': False,
+}
+
+
+def iperf3(name, pps, cpu_pct, files):
+    """Sum up the iperf3 runs of a throughput case."""
+    bps = 0.0
+    lost = 0
+    for path in files:
+        with open(path) as f:
+            end = json.load(f)['end']
+        # Received TCP bytes, or UDP datagrams not lost
+        total = end.get('sum_received', end.get('sum', {}))
+        bps += total.get('bits_per_second', 0.0)
+        lost += end.get('sum', {}).get('lost_packets', 0)
+
+    return {
+        'name': name,
+        'gbps': round(bps / 1e9, 4),
+        'pps': int(float(pps)),
+        'cpu_pct': round(float(cpu_pct), 1),
+        'lost': lost,
+    }
+
+
+def sockperf(name, path):
+    """Pick the round-trip percentiles of a latency case, in microseconds."""
+    result = {'name': name}
+    percentiles = {'50.000': 'p50_us', '99.000': 'p99_us', '99.900': 'p999_us'}
+    with open(path) as f:
+        for line in f:
+            m = re.search(r'percentile (\S+) = +([\d.]+)', line)
+            if m and m.group(1) in percentiles:
+                result[percentiles[m.group(1)]] = float(m.group(2))
+            m = re.search(r'Summary: Round trip is ([\d.]+) usec', line)
+            if m:
+                result['mean_us'] = float(m.group(1))
+
+    return result
+
+
+def meminfo(path):
+    """Read /proc/meminfo, in bytes."""
+    info = {}
+    with open(path) as f:
+        for line in f:
+            key, value = line.split(':')
+            info[key] = int(value.split()[0]) * 1024
+    return info
+
+
+def memory(name, stations, before_path, after_path, vwifi_path):
+    """Divide the memory taken by the stations of a footprint case."""
+    stations = int(stations)
+    before = meminfo(before_path)
+    after = meminfo(after_path)
+    result = {'name': name, 'stations': stations}
+
+    result['bytes_per_sta'] = \
+        (before['MemAvailable'] - after['MemAvailable']) // stations
+    result['slab_per_sta'] = (after['Slab'] - before['Slab']) // stations
+
+    # Objects accounted by vwifi itself, from /sys/kernel/debug/vwifi/memory
+    with open(vwifi_path) as f:
+        for line in f.readlines()[1:]:
+            kind, objs, nbytes = line.split()
+            result[kind + '_objs'] = int(objs)
+            result[kind + '_bytes'] = int(nbytes)
+    if 'total_bytes' not in result:
+        return None
+    result['vwifi_per_sta'] = result['total_bytes'] // stations
+
+    return result
+
+
+def load(name, load_ms, unload_ms, init_path, log_path):
+    """Break the load and unload times of a case down into phases."""
+    result = {
+        'name': name,
+        'load_ms': int(load_ms),
+        'unload_ms': int(unload_ms),
+    }
+
+    # From /sys/kernel/debug/vwifi/init_timings
+    with open(init_path) as f:
+        for line in f.readlines()[1:]:
+            phase, us = line.split()
+            result['init_%s_ms' % phase] = round(int(us) / 1000.0, 3)
+
+    # From the kernel log, printed by vwifi_exit()
+    with open(log_path) as f:
+        for line in f:
+            m = re.search(r'vwifi: exit phase (\S+) (\d+) us', line)
+            if m:
+                result['exit_%s_ms' % m.group(1)] = \
+                    round(int(m.group(2)) / 1000.0, 3)
+
+    return result
+
+
+def git_commit():
+    try:
+        return subprocess.check_output(
+            ['git', 'describe', '--always', '--dirty'],
+            cwd=os.path.dirname(os.path.abspath(__file__)),
+            stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def compare(results, baseline, threshold):
+    """Print how @results moved from @baseline. Return the regressions."""
+    base = {r['name']: r for r in baseline['results']}
+    regressions = 0
+
+    print('%-32s %-14s %14s %14s %8s' %
+          ('case', 'metric', 'baseline', 'now', 'change'))
+    for r in results:
+        b = base.get(r['name'])
+        if not b:
+            continue
+        for metric, higher_is_better in METRICS.items():
+            if metric not in r or not b.get(metric):
+                continue
+            change = (r[metric] - b[metric]) * 100.0 / b[metric]
+            worse = -change if higher_is_better else change
+            mark = ''
+            if worse > threshold:
+                mark = ' REGRESSION'
+                regressions += 1
+            print('%-32s %-14s %14g %14g %+7.1f%%%s' %
+                  (r['name'], metric, b[metric], r[metric], change, mark))
+
+    return regressions
+
+
+def report(results_path, report_path, baseline_path=None):
+    with open(results_path) as f:
+        results = [json.loads(line) for line in f if line.strip()]
+
+    with open(report_path, 'w') as f:
+        json.dump({
+            'date': datetime.datetime.now().isoformat(timespec='seconds'),
+            'kernel': platform.release(),
+            'commit': git_commit(),
+            'results': results,
+        }, f, indent=2)
+        f.write('\n')
+    print('%d results written to %s' % (len(results), report_path))
+
+    if not baseline_path or not os.path.exists(baseline_path):
+        return 0
+
+    with open(baseline_path) as f:
+        baseline = json.load(f)
+    threshold = float(os.environ.get('BENCH_THRESHOLD', '10'))
+    regressions = compare(results, baseline, threshold)
+    print('%d regressions (threshold %g%%) against %s' %
+          (regressions, threshold, baseline_path))
+
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    if len(sys.argv) >= 6 and sys.argv[1] == 'iperf3':
+        print(json.dumps(iperf3(sys.argv[2], sys.argv[3], sys.argv[4],
+                                sys.argv[5:])))
+    elif len(sys.argv) == 4 and sys.argv[1] == 'sockperf':
+        print(json.dumps(sockperf(sys.argv[2], sys.argv[3])))
+    elif len(sys.argv) == 7 and sys.argv[1] == 'memory':
+        result = memory(*sys.argv[2:])
+        if not result:
+            sys.exit(1)
+        print(json.dumps(result))
+    elif len(sys.argv) == 7 and sys.argv[1] == 'load':
+        print(json.dumps(load(*sys.argv[2:])))
+    elif len(sys.argv) in (4, 5) and sys.argv[1] == 'report':
+        sys.exit(report(*sys.argv[2:]))
+    else:
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
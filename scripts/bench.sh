@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+
+# Measure the throughput of the vwifi data path over standard topologies, and
+# compare it with a baseline, to catch regressions across releases.
+#
+# Usage: scripts/bench.sh [report JSON] [baseline JSON]
+#
+# With vw0 as the AP and vw1 ... vwN as STAs, the topologies are:
+#   sta-ap      vw1 -> vw0
+#   sta-ap-sta  vw1 -> vw2, relayed by the AP
+#   fanout      vw0 -> vw1 ... vwN at once (iperf3 can't broadcast)
+#   incast      vw1 ... vwN -> vw0 at once
+# Each of them runs iperf3 over TCP and UDP, for every packet size and number
+# of flows per sender below. A case reports the received Gbps, the frames per
+# second received by the destination interfaces, and the CPU usage of the
+# whole system, vwifi running in softirqs and workqueues.
+#
+# Save a report as the baseline to compare the next runs with it.
+
+export ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+source $ROOT/scripts/common.sh
+
+report=${1:-$ROOT/bench-report.json}
+baseline=${2:-$ROOT/bench-baseline.json}
+nr_sta=${NR_STA:-4}
+duration=${DURATION:-5}
+topologies=${TOPOLOGIES:-"sta-ap sta-ap-sta fanout incast"}
+sizes=${SIZES:-"64 512 1400"}
+flows=${FLOWS:-"1 4"}
+
+tmp=$(mktemp -d)
+results=$tmp/results.jsonl
+
+bench_setup station=$((nr_sta + 1)) hostapd iperf3 python3
+
+function cleanup() {
+    sudo pkill -x iperf3 > /dev/null
+    stop_bss $nr_sta
+    rm -rf $tmp
+}
+
+# Frames received by the interfaces vw<index> given
+function rx_packets() {
+    local sum=0 i
+    for i in "$@"; do
+        sum=$((sum + $(sudo ip netns exec ns$i \
+            cat /sys/class/net/vw$i/statistics/rx_packets)))
+    done
+    echo $sum
+}
+
+# Busy and total time of all CPUs, in ticks
+function cpu_ticks() {
+    awk '/^cpu / { busy = $2 + $3 + $4 + $7 + $8 + $9;
+                   print busy, busy + $5 + $6 }' /proc/stat
+}
+
+# Run iperf3 between the (source, destination) pairs of a topology
+function run_case() {
+    local topo=$1 proto=$2 size=$3 nr_flows=$4
+    local name=$topo/$proto/$size/$nr_flows
+    local pairs=() dsts=() args k src dst
+
+    case $topo in
+    sta-ap) pairs=("1 0") ;;
+    sta-ap-sta) pairs=("1 2") ;;
+    fanout) for i in $(seq 1 $nr_sta); do pairs+=("0 $i"); done ;;
+    incast) for i in $(seq 1 $nr_sta); do pairs+=("$i 0"); done ;;
+    esac
+
+    args="-t $duration -P $nr_flows -J"
+    if [ $proto = udp ]; then
+        args="$args -u -b 0 -l $size"
+    else
+        # Linux doesn't go below an MSS of 88 bytes
+        args="$args -M $((size > 88 ? size : 88))"
+    fi
+
+    mkdir -p $tmp/case
+    rm -f $tmp/case/*
+    for k in ${!pairs[@]}; do
+        read src dst <<< "${pairs[$k]}"
+        sudo ip netns exec ns$dst iperf3 -s -1 -D -p $((5201 + k))
+        dsts+=($dst)
+    done
+    dsts=($(printf "%s\n" "${dsts[@]}" | sort -u))
+    sleep 0.5
+
+    local rx_start=$(rx_packets ${dsts[@]})
+    read busy_start total_start <<< "$(cpu_ticks)"
+
+    for k in ${!pairs[@]}; do
+        read src dst <<< "${pairs[$k]}"
+        sudo ip netns exec ns$src iperf3 -c 10.0.0.$((dst + 1)) \
+            -p $((5201 + k)) $args > $tmp/case/$k.json &
+    done
+    wait
+
+    local rx_end=$(rx_packets ${dsts[@]})
+    read busy_end total_end <<< "$(cpu_ticks)"
+    sudo pkill -x iperf3 > /dev/null
+
+    local pps=$(((rx_end - rx_start) / duration))
+    local cpu=$(awk -v b=$((busy_end - busy_start)) \
+        -v t=$((total_end - total_start)) 'BEGIN { print t ? 100 * b / t : 0 }')
+
+    python3 $ROOT/scripts/bench.py iperf3 $name $pps $cpu $tmp/case/*.json \
+        >> $results
+    if [ $? -ne 0 ]; then
+        echo "$name: iperf3 failed"
+        return 1
+    fi
+    tail -n 1 $results
+}
+
+if [ $final_ret -eq 0 ]; then
+    # to avoid device or resource busy error
+    sleep 0.5
+
+    start_bss $nr_sta
+    if [ $? -ne 0 ]; then
+        final_ret=4
+    fi
+fi
+
+if [ $final_ret -eq 0 ]; then
+    echo
+    echo "================================================================================"
+    echo "Throughput matrix: $topologies, $duration seconds per case"
+    echo "================================================================================"
+    for topo in $topologies; do
+        for proto in tcp udp; do
+            for size in $sizes; do
+                for nr_flows in $flows; do
+                    run_case $topo $proto $size $nr_flows
+                    if [ $? -ne 0 ]; then
+                        final_ret=5
+                    fi
+                done
+            done
+        done
+    done
+fi
+
+bench_report $results $report $baseline
+cleanup
+bench_exit
@@ -13,7 +13,7 @@ function check_kmod() {
 function insert_kmod() {
     local mod_name=$1
     local param=$2
-    local noko_name=$(echo $mod_name |sed s/.ko//)
+    local noko_name=$(basename $mod_name .ko)
     check_kmod $noko_name
     ret=$?
     if [ $ret -eq 0 ] ; then
@@ -71,4 +71,98 @@ function get_wiphy_name() {
     local wiphy_name=$(sudo iw dev $interface_name info | grep wiphy | awk '{print $2}')
     wiphy_name=$(sudo iw list | grep "wiphy index: $wiphy_name" -B 1 | grep Wiphy | awk '{print $2}')
     echo $wiphy_name
-}
\ No newline at end of file
+}
+
+# Set up a BSS with vw0 as the AP and vw1 ... vw$1 as STAs, each interface in
+# its own namespace (ns0 ... ns$1) with the address 10.0.0.<index + 1>/24.
+# Return the number of STAs which failed to connect.
+function start_bss() {
+    local nr_sta=$1
+    local i phy
+
+    for i in $(seq 0 $nr_sta); do
+        phy=$(get_wiphy_name vw$i)
+        sudo ip netns add ns$i
+        sudo iw phy $phy set netns name ns$i
+        sudo ip netns exec ns$i ip link set lo up
+        sudo ip netns exec ns$i ip link set vw$i up
+        sudo ip netns exec ns$i ip addr add 10.0.0.$((i + 1))/24 dev vw$i
+    done
+
+    sudo ip netns exec ns0 hostapd -B $ROOT/scripts/hostapd.conf > /dev/null
+
+    for i in $(seq 1 $nr_sta); do
+        sudo ip netns exec ns$i iw dev vw$i connect test
+    done
+
+    local connected=$(sudo ip netns exec ns0 iw dev vw0 station dump | grep -c Station)
+    echo "$connected of $nr_sta STAs connected to AP vw0"
+    return $((nr_sta - connected))
+}
+
+# Undo start_bss, and remove vwifi
+function stop_bss() {
+    local nr_sta=$1
+    local i
+
+    stop_hostapd
+    remove_kmod vwifi
+    for i in $(seq 0 $nr_sta); do
+        sudo ip netns del ns$i 2> /dev/null
+    done
+}
+
+# Prologue of the benchmarks: load cfg80211, then vwifi with the parameters
+# $1 unless empty, and check that the tools given next are installed. Set
+# final_ret to 1, 2 or 3 if any of these steps failed, 0 otherwise.
+function bench_setup() {
+    local params=$1
+    local tool
+    shift
+
+    final_ret=0
+
+    probe_kmod cfg80211
+    if [ $? -ne 0 ]; then
+        final_ret=1
+    fi
+
+    if [ -n "$params" ]; then
+        insert_kmod $ROOT/vwifi.ko "$params"
+        if [ $? -ne 0 ]; then
+            final_ret=2
+        fi
+    fi
+
+    for tool in "$@"; do
+        which $tool > /dev/null
+        if [ $? -ne 0 ]; then
+            final_ret=3
+        fi
+    done
+}
+
+# Gather the results $1 of a benchmark into the report $2, compared with the
+# baseline $3, unless it failed already. Set final_ret to 6 on regressions.
+function bench_report() {
+    if [ $final_ret -ne 0 ]; then
+        return
+    fi
+
+    python3 $ROOT/scripts/bench.py report $1 $2 $3
+    if [ $? -ne 0 ]; then
+        final_ret=6
+    fi
+}
+
+# Epilogue of the benchmarks: tell and exit with final_ret
+function bench_exit() {
+    if [ $final_ret -eq 0 ]; then
+        echo "==== Test PASSED ===="
+        exit 0
+    fi
+
+    echo "FAILED (code: $final_ret)"
+    echo "==== Test FAILED ===="
+    exit $final_ret
+}
@@ -0,0 +1,130 @@
+#!/usr/bin/env bash
+
+# Flood broadcast frames through a large BSS and make sure the AP relay path
+# neither grows the kernel stack nor triggers softlockups.
+#
+# Usage: scripts/relay-stress.sh [number of STAs] [flood duration in seconds]
+
+export ROOT="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+source $ROOT/scripts/common.sh
+
+nr_sta=${1:-64}
+duration=${2:-30}
+# Maximum stack depth (bytes) reported by the ftrace stack tracer
+max_stack=${MAX_STACK:-8192}
+stack_tracer=/proc/sys/kernel/stack_tracer_enabled
+stack_max_size=/sys/kernel/debug/tracing/stack_max_size
+
+final_ret=0
+
+probe_kmod cfg80211
+if [ $? -ne 0 ]; then
+    final_ret=1
+fi
+
+insert_kmod vwifi.ko station=$((nr_sta + 1))
+if [ $? -ne 0 ]; then
+    final_ret=2
+fi
+
+which hostapd > /dev/null
+if [ $? -ne 0 ]; then
+    final_ret=3
+fi
+
+# Without it, the stack depth would go unchecked
+if [ ! -e $stack_tracer ]; then
+    echo "stack tracer not available, CONFIG_STACK_TRACER is required"
+    final_ret=9
+fi
+
+function cleanup() {
+    sudo pkill -f "ping -b" > /dev/null
+    stop_hostapd
+    remove_kmod vwifi
+    for i in $(seq 0 $nr_sta); do
+        sudo ip netns del ns$i 2> /dev/null
+    done
+}
+
+if [ $final_ret -eq 0 ]; then
+    # to avoid device or resource busy error
+    sleep 0.5
+
+    # vw0 is the AP, vw1 ... vwN are STAs, each in its own namespace
+    for i in $(seq 0 $nr_sta); do
+        phy=$(get_wiphy_name vw$i)
+        sudo ip netns add ns$i
+        sudo iw phy $phy set netns name ns$i
+        sudo ip netns exec ns$i ip link set lo up
+        sudo ip netns exec ns$i ip link set vw$i up
+        sudo ip netns exec ns$i ip addr add 10.0.$((i / 250)).$((i % 250 + 1))/16 dev vw$i
+        # let every STA answer broadcast pings to multiply the relay load
+        sudo ip netns exec ns$i sysctl -qw net.ipv4.icmp_echo_ignore_broadcasts=0
+    done
+
+    sudo ip netns exec ns0 hostapd -B $ROOT/scripts/hostapd.conf > /dev/null
+
+    for i in $(seq 1 $nr_sta); do
+        sudo ip netns exec ns$i iw dev vw$i connect test
+    done
+
+    connected=$(sudo ip netns exec ns0 iw dev vw0 station dump | grep -c Station)
+    echo "$connected of $nr_sta STAs connected to AP vw0"
+    if [ $connected -ne $nr_sta ]; then
+        final_ret=4
+    fi
+fi
+
+if [ $final_ret -eq 0 ]; then
+    echo 1 | sudo tee $stack_tracer > /dev/null
+    echo 0 | sudo tee $stack_max_size > /dev/null
+
+    marker="vwifi relay stress $(date +%s)"
+    echo "$marker" | sudo tee /dev/kmsg > /dev/null
+
+    echo
+    echo "================================================================================"
+    echo "Flooding broadcast through AP vw0 from 4 STAs for $duration seconds"
+    echo "================================================================================"
+    for i in $(seq 1 4); do
+        sudo ip netns exec ns$i timeout $duration \
+            ping -b -f -q 10.0.255.255 > /dev/null 2>&1 &
+    done
+    wait
+
+    if sudo dmesg | sed -n "/$marker/,\$p" |
+        grep -E "soft lockup|stack-protector|stack guard|BUG:|Oops" > /dev/null; then
+        echo "kernel reported a softlockup or stack overflow"
+        final_ret=5
+    fi
+
+    echo 0 | sudo tee $stack_tracer > /dev/null
+    depth=$(sudo cat $stack_max_size)
+    echo "maximum stack depth: $depth bytes"
+    if [ $depth -gt $max_stack ]; then
+        final_ret=6
+    fi
+
+    tx=$(sudo ip netns exec ns0 cat /sys/class/net/vw0/statistics/tx_packets)
+    echo "AP vw0 relayed $tx frames"
+    if [ $tx -eq 0 ]; then
+        final_ret=7
+    fi
+
+    lsmod | grep vwifi > /dev/null
+    if [ $? -ne 0 ]; then
+        final_ret=8
+    fi
+fi
+
+cleanup
+
+if [ $final_ret -eq 0 ]; then
+    echo "==== Test PASSED ===="
+    exit 0
+fi
+
+echo "FAILED (code: $final_ret)"
+echo "==== Test FAILED ===="
+exit $final_ret
@@ -0,0 +1,59 @@
+#ifndef VWIFI_MEDIUM_H
+#define VWIFI_MEDIUM_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* The vwifi medium, exposed to a userspace process through /dev/vwifi.
+ *
+ * After VWIFI_MEDIUM_SETUP, mmap() maps the RX ring followed by the TX ring.
+ * Each ring is made of frame_nr slots of frame_size bytes. A slot starts with
+ * struct vwifi_medium_desc, and the frame (as carried between vifs, starting
+ * with its Ethernet header) follows at VWIFI_MEDIUM_HDRLEN.
+ *
+ * RX: every frame crossing the medium is copied to the next slot, which is
+ * then handed to userspace (VWIFI_MEDIUM_USER). Userspace gives the slot back
+ * by setting VWIFI_MEDIUM_KERNEL. Frames arriving while the next slot is
+ * still owned by userspace are dropped. poll() and the eventfd registered by
+ * VWIFI_MEDIUM_EVENTFD are notified once per batch of frames.
+ *
+ * TX: userspace fills slots in order, marks them VWIFI_MEDIUM_SEND, then
+ * VWIFI_MEDIUM_TX delivers all of them to the vifs given by their dst field
+ * and gives the slots back (VWIFI_MEDIUM_KERNEL).
+ */
+
+#define VWIFI_MEDIUM_KERNEL 0 /* owned by the kernel, or free for TX */
+#define VWIFI_MEDIUM_USER 1   /* RX frame owned by userspace */
+#define VWIFI_MEDIUM_SEND 2   /* TX frame to be sent */
+
+struct vwifi_medium_desc {
+    __u32 status;
+    __u32 len;    /* length of the frame */
+    __u32 caplen; /* bytes of the frame in the slot */
+    __u32 reserved;
+    __u64 tstamp_ns; /* RX: time the frame was sent (CLOCK_MONOTONIC) */
+    __u8 src[6];     /* RX: address of the sending vif */
+    __u8 dst[6];     /* address of the receiving vif */
+    __u32 reserved2;
+};
+
+#define VWIFI_MEDIUM_HDRLEN 48
+
+struct vwifi_medium_req {
+    __u32 frame_size; /* multiple of 16, at most 64 KiB */
+    __u32 frame_nr;   /* power of 2, per ring */
+};
+
+struct vwifi_medium_stats {
+    __u64 rx_frames;
+    __u64 rx_dropped; /* RX ring full */
+    __u64 tx_frames;
+    __u64 tx_errors; /* unknown vif or invalid length */
+};
+
+#define VWIFI_MEDIUM_SETUP _IOW('v', 1, struct vwifi_medium_req)
+#define VWIFI_MEDIUM_EVENTFD _IOW('v', 2, __s32)
+#define VWIFI_MEDIUM_TX _IO('v', 3)
+#define VWIFI_MEDIUM_STATS _IOR('v', 4, struct vwifi_medium_stats)
+
+#endif /* VWIFI_MEDIUM_H */
@@ -1,22 +1,46 @@
+#include <linux/debugfs.h>
+#include <linux/error-injection.h>
 #include <linux/etherdevice.h>
+#include <linux/eventfd.h>
 #include <linux/hashtable.h>
 #include <linux/hrtimer.h>
+#include <linux/if_arp.h>
+#include <linux/igmp.h>
+#include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
 #include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/sort.h>
 #include <linux/string.h>
 #include <linux/timer.h>
+#include <linux/udp.h>
 #include <linux/version.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
 #include <linux/virtio_ids.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
+#include <net/arp.h>
 #include <net/cfg80211.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/mld.h>
+#include <net/ndisc.h>
 #include <uapi/linux/virtio_net.h>
 
 #include <linux/netlink.h>
 #include <net/sock.h>
 
+#include "vwifi-medium.h"
+
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
 MODULE_DESCRIPTION("virtual cfg80211 driver");
@@ -35,6 +59,64 @@ MODULE_DESCRIPTION("virtual cfg80211 driver");
 
 #define SCAN_TIMEOUT_MS 100 /*< millisecond */
 
+/* Interval (in ms) of the beacons of an AP without receivers. It stays below
+ * the 30 s after which cfg80211 expires BSS entries.
+ */
+#define VWIFI_BEACON_PARK_MS 10000
+
+/* A virtio scan completes once no response arrived for this long */
+#define VWIFI_VIRTIO_SCAN_QUIET_MS 50
+
+/* Interval (in ms) of the sweep disassociating idle STAs from their AP */
+#define VWIFI_INACTIVITY_SWEEP_MS 1000
+
+/* Maximum number of BSSes of a multi-BSSID AP radio */
+#define VWIFI_MBSSID_MAX 8
+
+/* Maximum number of scan plans of a scheduled scan */
+#define VWIFI_SCHED_SCAN_MAX_PLANS 8
+
+/* Maximum number of frames an AP processes per run of its RX work before
+ * yielding the worker.
+ */
+#define VWIFI_RX_BUDGET 64
+
+/* Maximum number of frames waiting in the rx_queue of a vif. Frames beyond
+ * are dropped and counted in rx_dropped, like a NIC out of RX descriptors.
+ */
+#define VWIFI_RX_QUEUE_MAX 1000
+
+/* Proxy ARP/ND binding table of an AP */
+#define VWIFI_NEIGH_HASH_BITS 6
+#define VWIFI_NEIGH_MAX 4096
+#define VWIFI_NEIGH_TIMEOUT (300 * HZ)
+
+/* IGMP/MLD snooping group table of an AP */
+#define VWIFI_MCAST_HASH_BITS 6
+#define VWIFI_MCAST_MAX 1024
+/* Group membership interval of IGMPv3/MLDv2 with the default timers */
+#define VWIFI_MCAST_TIMEOUT (260 * HZ)
+
+/* Spatial index of the vifs, see vwifi_grid */
+#define VWIFI_GRID_HASH_BITS 10
+
+/* Lightweight STAs, hashed by MAC. A STA sends at most VWIFI_LSTA_BURST frames
+ * per run of the traffic generator, and they are associated VWIFI_LSTA_BATCH at
+ * a time.
+ */
+#define VWIFI_LSTA_HASH_BITS 12
+#define VWIFI_LSTA_BURST 32
+#define VWIFI_LSTA_BATCH 256
+
+/* Earliest departure time (EDT) timer wheel geometry. Each slot covers
+ * 2^VWIFI_EDT_SLOT_SHIFT ns (~524 us), so the wheel spans ~134 ms. Frames
+ * whose skb->tstamp lies beyond the horizon are not considered paced.
+ */
+#define VWIFI_EDT_WHEEL_SLOTS 256
+#define VWIFI_EDT_SLOT_SHIFT 19
+#define VWIFI_EDT_HORIZON_NS \
+    ((u64) VWIFI_EDT_WHEEL_SLOTS << VWIFI_EDT_SLOT_SHIFT)
+
 /* Note: vwifi_cipher_suites is an array of int defining which cipher suites
  * are supported. A pointer to this array and the number of entries is passed
  * on to upper layers.
@@ -46,12 +128,100 @@ static const u32 vwifi_cipher_suites[] = {
     WLAN_CIPHER_SUITE_CCMP,
 };
 
+/* Objects allocated by vwifi, accounted in the "memory" debugfs file */
+enum vwifi_mem_type {
+    VWIFI_MEM_VIF,          /**< struct vwifi_vif, private to its net_device */
+    VWIFI_MEM_BAND,         /**< channels and bitrates of a wiphy */
+    VWIFI_MEM_PACKET,       /**< struct vwifi_packet, queued or in flight */
+    VWIFI_MEM_STA_ENTRY,    /**< struct bss_sta_entry */
+    VWIFI_MEM_IE,           /**< IEs cached by STAs, vwifi_ie_cache_store() */
+    VWIFI_MEM_LSTA,         /**< struct vwifi_lsta */
+    VWIFI_MEM_NEIGH,        /**< struct vwifi_neigh_entry */
+    VWIFI_MEM_MCAST_GROUP,  /**< struct vwifi_mcast_group */
+    VWIFI_MEM_MCAST_MEMBER, /**< struct vwifi_mcast_member */
+    VWIFI_MEM_TYPES,
+};
+
+static const char *const vwifi_mem_names[VWIFI_MEM_TYPES] = {
+    [VWIFI_MEM_VIF] = "vif",
+    [VWIFI_MEM_BAND] = "band",
+    [VWIFI_MEM_PACKET] = "packet",
+    [VWIFI_MEM_STA_ENTRY] = "sta_entry",
+    [VWIFI_MEM_IE] = "ie",
+    [VWIFI_MEM_LSTA] = "lite_station",
+    [VWIFI_MEM_NEIGH] = "neigh",
+    [VWIFI_MEM_MCAST_GROUP] = "mcast_group",
+    [VWIFI_MEM_MCAST_MEMBER] = "mcast_member",
+};
+
+/* Per CPU, to keep the data path free of shared cache lines. An object may be
+ * freed on another CPU than the one which allocated it, so only the sums over
+ * all CPUs make sense.
+ */
+struct vwifi_mem_stat {
+    long objs;
+    long bytes;
+};
+
+static DEFINE_PER_CPU(struct vwifi_mem_stat[VWIFI_MEM_TYPES], vwifi_mem_stats);
+
+static inline void vwifi_mem_add(enum vwifi_mem_type type, size_t bytes)
+{
+    this_cpu_inc(vwifi_mem_stats[type].objs);
+    this_cpu_add(vwifi_mem_stats[type].bytes, bytes);
+}
+
+static inline void vwifi_mem_sub(enum vwifi_mem_type type, size_t bytes)
+{
+    this_cpu_dec(vwifi_mem_stats[type].objs);
+    this_cpu_sub(vwifi_mem_stats[type].bytes, bytes);
+}
+
 struct vwifi_packet {
     int datalen;
     u8 data[ETH_DATA_LEN];
     struct list_head list;
+    /* earliest departure time (CLOCK_MONOTONIC, in ns), 0 if not paced */
+    u64 edt;
+    /* skb->mark and skb->priority of the received frame */
+    u32 mark;
+    u32 priority;
 };
 
+/* Frame metadata handed to the link model, see vwifi_link_verdict() */
+struct vwifi_link_meta {
+    u32 len;
+    __be16 proto;
+    s32 src_x, src_y; /**< position of the sender */
+    s32 dst_x, dst_y; /**< position of the receiver */
+    u64 now_ns;       /**< CLOCK_MONOTONIC */
+};
+
+/* Verdicts of the link model. A negative one drops the frame. Otherwise, the
+ * frame is delayed by the microseconds in the low bits, and received with the
+ * priority (rate class) and the mark in the high bits.
+ */
+#define VWIFI_LINK_DELAY_MASK 0x1ffff /* up to 131 ms */
+#define VWIFI_LINK_PRIO_SHIFT 20
+#define VWIFI_LINK_PRIO_MASK 0xf
+#define VWIFI_LINK_MARK_SHIFT 24
+#define VWIFI_LINK_MARK_MASK 0x7f
+
+static struct vwifi_packet *vwifi_packet_alloc(gfp_t gfp)
+{
+    struct vwifi_packet *pkt = kmalloc(sizeof(*pkt), gfp);
+
+    if (pkt)
+        vwifi_mem_add(VWIFI_MEM_PACKET, sizeof(*pkt));
+    return pkt;
+}
+
+static void vwifi_packet_free(struct vwifi_packet *pkt)
+{
+    vwifi_mem_sub(VWIFI_MEM_PACKET, sizeof(*pkt));
+    kfree(pkt);
+}
+
 enum vwifi_state { VWIFI_READY, VWIFI_SHUTDOWN };
 
 /* Context for the whole program, so there's only single vwifi_context
@@ -79,6 +249,49 @@ enum sme_state { SME_DISCONNECTED, SME_CONNECTING, SME_CONNECTED };
  */
 static atomic_t vwifi_wiphy_counter = ATOMIC_INIT(0);
 
+/* Per-vif timer wheel holding frames until their earliest departure time.
+ * Frames are hashed into slots by EDT, and a single hrtimer is armed for the
+ * earliest pending frame, so the cost does not depend on the number of paced
+ * frames in flight.
+ */
+struct vwifi_edt_wheel {
+    spinlock_t lock;
+    struct list_head slots[VWIFI_EDT_WHEEL_SLOTS];
+    unsigned int count; /**< number of frames held in the wheel */
+    u64 clk;            /**< time (in ns) up to which the wheel is drained */
+    struct hrtimer timer;
+    struct work_struct work;
+};
+
+/* BSS report data of an AP, captured once and reported to every STA scanning
+ * at that time.
+ */
+struct vwifi_scan_bss {
+    u8 bssid[ETH_ALEN];
+    u8 ssid[IEEE80211_MAX_SSID_LEN];
+    size_t ssid_len;
+    u32 freq;
+    u16 capability;
+    /* SSIDs of the non-transmitted BSSes, carried in the Multiple BSSID
+     * element of the IEs.
+     */
+    u8 n_nontx;
+    struct cfg80211_ssid nontx_ssid[VWIFI_MBSSID_MAX - 1];
+    s32 x, y;  /**< position of the AP */
+    u64 cell;  /**< grid cell of the AP, the snapshot is sorted by it */
+    u32 hash; /**< of the BSSID, SSID and IEs, to detect changes */
+    u32 ie_len;
+    u8 ie[IE_MAX_LEN];
+};
+
+/* Snapshot of the enabled APs, shared by all the scans it is reported to */
+struct vwifi_scan_snap {
+    struct kref ref;
+    u64 tsf; /**< capture time, in us of CLOCK_BOOTTIME */
+    unsigned int n_bss;
+    struct vwifi_scan_bss bss[];
+};
+
 /* Virtual interface pointed to by netdev_priv(). Fields in the structure are
  * interface-dependent. Every interface has its own vwifi_vif, regardless of the
  * interface mode (STA, AP, Ad-hoc...).
@@ -94,6 +307,15 @@ struct vwifi_vif {
     u8 ssid[IEEE80211_MAX_SSID_LEN];
 
     struct list_head rx_queue; /**< Head of received packet queue */
+    unsigned int rx_queue_len; /**< frames in rx_queue, guarded by lock */
+    /* Frames waiting for their earliest departure time before entering
+     * rx_queue.
+     */
+    struct vwifi_edt_wheel edt;
+    /* Drains rx_queue of an AP, so relaying runs in the AP's own context
+     * instead of on the stack of the transmitting STA.
+     */
+    struct work_struct ws_rx;
     /* Store all vwifi_vif which is in the same BSS (AP will be the head). */
     struct list_head bss_list;
     /* List entry for maintaining all vwifi_vif, which can be accessed via
@@ -114,15 +336,40 @@ struct vwifi_vif {
             enum sme_state sme_state; /* connection information */
             /* last connection time to a AP (in jiffies) */
             unsigned long conn_time;
-            unsigned long active_time; /**< last tx/rx time (in jiffies) */
             u16 disconnect_reason_code;
 
             struct timer_list scan_timeout;
+            /* Progress of a virtio scan: the latest completion time (in
+             * jiffies), whether it asks for every SSID, the responses so far
+             * and the responses to the last wildcard scan.
+             */
+            unsigned long scan_deadline;
+            bool scan_wildcard;
+            unsigned int scan_resps, scan_known_aps;
             struct work_struct ws_connect, ws_disconnect;
             struct work_struct ws_scan, ws_scan_timeout;
 
+            /* Entry in vwifi_scan_batch while waiting for the scan window to
+             * close, and the AP snapshot the scan is then served from.
+             */
+            struct list_head scan_batch;
+            struct vwifi_scan_snap *scan_snap;
+
+            /* Scheduled scan, run by the work shared by all STAs. Guarded by
+             * vwifi_sched_scan_lock.
+             */
+            struct cfg80211_sched_scan_request *sched_scan_req;
+            struct list_head sched_scan_list;
+            unsigned long sched_scan_next; /**< next pass (in jiffies) */
+            unsigned int sched_scan_plan, sched_scan_iter;
+            u32 sched_scan_sig; /**< signature of the reported matches */
+
             /* For quickly finding the AP */
             struct vwifi_vif *ap;
+            /* Last frame sent to the AP (in jiffies). Unlike active_time,
+             * frames received don't count: the STA is alive only if it sends.
+             */
+            unsigned long tx_time;
         };
         /* Structure for AP mode */
         struct {
@@ -135,15 +382,61 @@ struct vwifi_vif {
             /* beacon interval in us */
             u64 beacon_int;
             struct hrtimer beacon_timer;
+            /* No STA received the last beacon, the timer is parked */
+            bool beacon_parked;
             struct ieee80211_channel *channel;
             enum nl80211_chan_width bw;
+            /* STAs idle for longer are disassociated (in seconds, 0 for never)
+             */
+            u16 inactivity_timeout;
+
+            /* IP to MAC bindings of the STAs in the BSS, used to answer ARP
+             * requests and neighbor solicitations instead of flooding them.
+             */
+            DECLARE_HASHTABLE(neigh_table, VWIFI_NEIGH_HASH_BITS);
+            spinlock_t neigh_lock;
+            bool proxy_arp; /**< answer from neigh_table, or flood */
+            u32 neigh_num;
+            u64 proxy_arp_suppressed, proxy_arp_flooded;
+            u64 proxy_nd_suppressed, proxy_nd_flooded;
+
+            /* Multicast groups joined by the STAs in the BSS, learned by
+             * snooping IGMP/MLD reports.
+             */
+            DECLARE_HASHTABLE(mcast_table, VWIFI_MCAST_HASH_BITS);
+            spinlock_t mcast_lock;
+            u32 mcast_num;
+
+            /* Lightweight STAs associated to the AP, guarded by
+             * vwifi_lsta_lock. Beacons and broadcasts are counted once for
+             * all of them. The last station dump resumes from lsta_cursor.
+             */
+            struct list_head lsta_list;
+            u32 n_lsta;
+            u64 beacon_count;
+            u64 lsta_bcast, lsta_bcast_bytes;
+            struct vwifi_lsta *lsta_cursor;
+            int lsta_cursor_idx;
         };
     };
 
+    unsigned long active_time; /**< last tx/rx time (in jiffies) */
+
     struct timer_list scan_complete;
     u8 req_bssid[ETH_ALEN];
     u32 beacon_ie_len;
     u8 beacon_ie[IE_MAX_LEN];
+    /* Changes along with beacon_ie, so that STAs reached over virtio can keep
+     * them across scans
+     */
+    u32 beacon_ie_gen;
+    /* Beacon IEs of the APs reached over virtio by BSSID, see
+     * struct vwifi_ie_cache_entry. Guarded by vif->lock.
+     */
+    DECLARE_HASHTABLE(ie_cache, 4);
+    u32 ie_cache_num;
+    /* Bumped by every scan request, the entries it lists are not evicted */
+    u32 ie_cache_seq;
 
     /* Store all STAs in the same BSS, right now only used when virtio enabled
      */
@@ -156,6 +449,20 @@ struct vwifi_vif {
     /* Packet virtio header size */
     u8 vnet_hdr_len;
 
+    /* Added on the wiphy of another vif through add_virtual_intf() */
+    bool secondary;
+    /* Transmitting BSS of a multi-BSSID AP (itself for the transmitting BSS,
+     * NULL for a standalone AP). The non-transmitted BSSes are linked on the
+     * mbssid list of the transmitting BSS. Guarded by vif_list_lock.
+     */
+    struct vwifi_vif *mbssid_tx;
+    struct list_head mbssid;
+
+    /* Position (in meters) and the cell of vwifi_grid holding the vif */
+    s32 pos_x, pos_y;
+    s32 cell_x, cell_y;
+    struct hlist_node grid_node;
+
     /* Transmit power */
     s32 tx_power;
 };
@@ -164,9 +471,98 @@ static int station = 2;
 module_param(station, int, 0444);
 MODULE_PARM_DESC(station, "Number of virtual interfaces running in STA mode.");
 
+static bool edt_pacing = true;
+module_param(edt_pacing, bool, 0644);
+MODULE_PARM_DESC(edt_pacing,
+                 "Hold frames until the earliest departure time in "
+                 "skb->tstamp (set by fq or TCP pacing).");
+
+static bool proxy_arp = false;
+module_param(proxy_arp, bool, 0644);
+MODULE_PARM_DESC(proxy_arp,
+                 "Let APs answer ARP requests and IPv6 neighbor solicitations "
+                 "on behalf of known STAs instead of flooding them. Default "
+                 "of the APs started afterwards, see debugfs proxy_neigh.");
+
+static bool mcast_snooping = false;
+module_param(mcast_snooping, bool, 0644);
+MODULE_PARM_DESC(mcast_snooping,
+                 "Let APs snoop IGMP/MLD and deliver multicast frames only to "
+                 "the STAs subscribed to the group.");
+
+static unsigned int virtio_scan_max_ms = 2000;
+module_param(virtio_scan_max_ms, uint, 0644);
+MODULE_PARM_DESC(virtio_scan_max_ms,
+                 "Maximum time (in ms) a scan waits for the responses of the "
+                 "APs reached over virtio.");
+
+static bool mcast_to_ucast = false;
+module_param(mcast_to_ucast, bool, 0644);
+MODULE_PARM_DESC(mcast_to_ucast,
+                 "Convert snooped multicast frames to unicast frames "
+                 "addressed to each subscribed STA.");
+
+static unsigned int radio_range = 0;
+module_param(radio_range, uint, 0444);
+MODULE_PARM_DESC(radio_range,
+                 "Radio range (in meters) within which STAs see APs. 0 makes "
+                 "every AP visible to every STA.");
+
 /* Global context */
 static struct vwifi_context *vwifi = NULL;
 
+/* Root of the debugfs entries, /sys/kernel/debug/vwifi */
+static struct dentry *vwifi_debugfs;
+
+/* Phases of module loading and unloading, timed to follow how they scale with
+ * the number of interfaces. The loading ones are listed in the "init_timings"
+ * debugfs file; the unloading ones, which outlive debugfs, go to the kernel
+ * log.
+ */
+enum vwifi_init_phase {
+    VWIFI_INIT_WIPHY,   /**< wiphy allocation and registration */
+    VWIFI_INIT_NETDEV,  /**< net_device allocation and registration */
+    VWIFI_INIT_NETLINK, /**< netlink socket */
+    VWIFI_INIT_VIRTIO,  /**< virtio driver registration */
+    VWIFI_INIT_MEDIUM,  /**< /dev/vwifi and debugfs */
+    VWIFI_INIT_PHASES,
+};
+
+static const char *const vwifi_init_names[VWIFI_INIT_PHASES] = {
+    [VWIFI_INIT_WIPHY] = "wiphy",     [VWIFI_INIT_NETDEV] = "netdev",
+    [VWIFI_INIT_NETLINK] = "netlink", [VWIFI_INIT_VIRTIO] = "virtio",
+    [VWIFI_INIT_MEDIUM] = "medium",
+};
+
+static u64 vwifi_init_ns[VWIFI_INIT_PHASES];
+
+enum vwifi_exit_phase {
+    VWIFI_EXIT_WORK,     /**< global work and debugfs, /dev/vwifi */
+    VWIFI_EXIT_VIRTIO,   /**< virtio driver unregistration */
+    VWIFI_EXIT_TEARDOWN, /**< queues, timers and work of the vifs */
+    VWIFI_EXIT_NETDEV,   /**< net_device unregistration */
+    VWIFI_EXIT_WIPHY,    /**< net_device and wiphy release */
+    VWIFI_EXIT_NETLINK,  /**< scans and netlink socket */
+    VWIFI_EXIT_PHASES,
+};
+
+static const char *const vwifi_exit_names[VWIFI_EXIT_PHASES] = {
+    [VWIFI_EXIT_WORK] = "work",         [VWIFI_EXIT_VIRTIO] = "virtio",
+    [VWIFI_EXIT_TEARDOWN] = "teardown", [VWIFI_EXIT_NETDEV] = "netdev",
+    [VWIFI_EXIT_WIPHY] = "wiphy",       [VWIFI_EXIT_NETLINK] = "netlink",
+};
+
+static u64 vwifi_exit_ns[VWIFI_EXIT_PHASES];
+
+/* Add the time elapsed since *@start to @phase, and restart from now */
+static inline void vwifi_phase_end(u64 *phase, u64 *start)
+{
+    u64 now = ktime_get_ns();
+
+    *phase += now - *start;
+    *start = now;
+}
+
 /* Denylist content */
 #define MAX_DENYLIST_SIZE 1024
 
@@ -245,26 +641,54 @@ static struct netlink_kernel_cfg nl_config = {
  *
  * For virtio-net device, We expect 1 RX virtqueue followed by 1 TX virtqueue,
  * followed by possible N-1 RX/TX queue pairs used in multiqueue mode, followed
- * by possible control vq. For now, we don't support multiqueue mode virtio-net
- * device and control vq as well, so there are only 1 RX vq and 1 TX vq.
+ * by possible control vq. We use the first queue pair for data frames, and
+ * when the device has several (VIRTIO_NET_F_MQ), the second one for the vwifi
+ * management frames, so that they do not wait behind data frames. The other
+ * queue pairs are unused.
  *
  * @VWIFI_VQ_TX: send frames to external entity
  * @VWIFI_VQ_RX: receive frames
+ * @VWIFI_VQ_MGMT_RX: receive management frames, NULL without VIRTIO_NET_F_MQ
+ * @VWIFI_VQ_MGMT_TX: send management frames, NULL without VIRTIO_NET_F_MQ
+ * @VWIFI_VQ_CTRL: program the device, e.g. its RX filter
  * @VWIFI_NUM_VQS: enum limit
  */
 enum {
     VWIFI_VQ_RX,
     VWIFI_VQ_TX,
+    VWIFI_VQ_MGMT_RX,
+    VWIFI_VQ_MGMT_TX,
+    VWIFI_VQ_CTRL,
     VWIFI_NUM_VQS,
 };
 
 static struct virtqueue *vwifi_vqs[VWIFI_NUM_VQS];
+static struct virtio_device *vwifi_vdev;
 static bool vwifi_virtio_enabled;
+/* The device reports the hash of received frames */
+static bool vwifi_virtio_hash;
 
 static DEFINE_SPINLOCK(vwifi_virtio_lock);
 
 static void vwifi_virtio_rx_work(struct work_struct *work);
 static DECLARE_WORK(vwifi_virtio_rx, vwifi_virtio_rx_work);
+static void vwifi_virtio_rx_mgmt_work(struct work_struct *work);
+static DECLARE_WORK(vwifi_virtio_rx_mgmt, vwifi_virtio_rx_mgmt_work);
+
+/* Buffers of the control vq, which must not live on the stack */
+struct vwifi_virtio_ctrl {
+    struct virtio_net_ctrl_hdr hdr;
+    virtio_net_ctrl_ack status;
+    u8 onoff;
+    struct virtio_net_ctrl_mq mq;
+};
+
+static struct vwifi_virtio_ctrl *vwifi_ctrl;
+/* Serializes the commands on the control vq */
+static DEFINE_MUTEX(vwifi_virtio_ctrl_lock);
+
+static void vwifi_virtio_rx_mode_work(struct work_struct *work);
+static DECLARE_WORK(vwifi_virtio_rx_mode, vwifi_virtio_rx_mode_work);
 
 /**
  * enum VWIFI_VIRTIO_PACKET_TYPE - non-standard management frame type for VWIFI
@@ -333,6 +757,12 @@ struct vwifi_virtio_header {
         struct vwifi_virtio_scan_req {
             __le32 ssid_len;
             u8 ssid[IEEE80211_MAX_SSID_LEN];
+            /* BSSes whose beacon IEs the STA holds, and their generation */
+            __le16 n_known;
+            struct vwifi_virtio_ie_gen {
+                u8 bssid[ETH_ALEN];
+                __le32 gen;
+            } __packed known[];
         } __packed scan_req;
         struct vwifi_virtio_scan_resp {
             u8 bssid[ETH_ALEN];
@@ -342,6 +772,9 @@ struct vwifi_virtio_header {
             __le32 ssid_len;
             u8 ssid[IEEE80211_MAX_SSID_LEN];
             __le32 channel; /* center frquency */
+            __le32 beacon_ie_gen;
+            /* The STA holds the IEs of beacon_ie_gen, beacon_ies is empty */
+            u8 beacon_ies_known;
             __le32 beacon_ies_len;
             u8 beacon_ies[];
         } __packed scan_resp;
@@ -376,8 +809,178 @@ enum VWIFI_STA_ENTRY_CMD {
 struct bss_sta_entry {
     struct hlist_node node;
     u8 mac[ETH_ALEN];
+    unsigned long active_time; /**< last frame from the STA (in jiffies) */
+};
+
+static struct bss_sta_entry *vwifi_sta_entry_alloc(gfp_t gfp)
+{
+    struct bss_sta_entry *sta_ent = kmalloc(sizeof(*sta_ent), gfp);
+
+    if (sta_ent)
+        vwifi_mem_add(VWIFI_MEM_STA_ENTRY, sizeof(*sta_ent));
+    return sta_ent;
+}
+
+static void vwifi_sta_entry_free(struct bss_sta_entry *sta_ent)
+{
+    vwifi_mem_sub(VWIFI_MEM_STA_ENTRY, sizeof(*sta_ent));
+    kfree(sta_ent);
+}
+
+/* At most that many BSSes in the IE cache of a STA, which all fit in a scan
+ * request
+ */
+#define VWIFI_IE_CACHE_MAX 64
+
+/* Beacon IEs of an AP reached over virtio. The STA lists the BSSes it holds
+ * in its scan requests, and the APs whose IEs did not change since then omit
+ * them from their responses.
+ */
+struct vwifi_ie_cache_entry {
+    struct hlist_node node;
+    u8 bssid[ETH_ALEN];
+    u32 gen;
+    unsigned long last_seen; /**< in jiffies, the oldest entry goes first */
+    u32 seq;                 /**< ie_cache_seq of the last request listing it */
+    u32 ies_len;
+    u8 ies[];
+};
+
+/* Traffic models of the lightweight STAs */
+enum vwifi_lsta_model {
+    VWIFI_LSTA_IDLE,    /**< sends nothing */
+    VWIFI_LSTA_CBR,     /**< constant bit rate */
+    VWIFI_LSTA_POISSON, /**< exponentially distributed gaps */
+    VWIFI_LSTA_ONOFF,   /**< CBR during exponential on and off periods */
+};
+
+/* A STA emulated without net_device nor wiphy, associated to an AP. It only
+ * generates frames towards its AP and counts the frames the AP sends to it.
+ * Guarded by vwifi_lsta_lock.
+ */
+struct vwifi_lsta {
+    struct hlist_node node; /**< entry of vwifi_lsta_table */
+    struct list_head bss;   /**< entry of ap->lsta_list */
+    struct vwifi_vif *ap;
+    u8 mac[ETH_ALEN];
+
+    enum vwifi_lsta_model model;
+    u32 rate;          /**< frames per second, while on */
+    u32 len;           /**< frame length */
+    u32 on_ms, off_ms; /**< mean on and off periods */
+    bool on;
+    u64 phase_end; /**< end of the on or off period (in ns) */
+    u64 next_tx;   /**< departure of the next frame (in ns) */
+
+    unsigned long conn_time, active_time; /**< in jiffies */
+    /* Broadcasts and beacons of the AP when the STA associated */
+    u64 bcast_base, bcast_bytes_base, beacon_base;
+    u64 tx_packets, tx_bytes, rx_packets, rx_bytes;
+};
+
+/* IP to MAC binding of a STA learned by an AP in proxy ARP/ND mode. IPv4
+ * addresses are stored as IPv4-mapped IPv6 addresses. The bindings of a STA
+ * go away when it leaves the BSS, see vwifi_neigh_forget().
+ */
+struct vwifi_neigh_entry {
+    struct hlist_node node;
+    struct in6_addr addr;
+    u8 mac[ETH_ALEN];
+    unsigned long updated; /**< last time the binding was seen (in jiffies) */
+};
+
+/* Multicast group joined by STAs of a BSS. IPv4 groups are stored as
+ * IPv4-mapped IPv6 addresses.
+ */
+struct vwifi_mcast_group {
+    struct hlist_node node;
+    struct in6_addr addr;
+    struct list_head members;
+    u32 nr_members;
+};
+
+/* Member of a group, until it leaves the group or the BSS, or stops
+ * reporting for VWIFI_MCAST_TIMEOUT
+ */
+struct vwifi_mcast_member {
+    struct list_head list;
+    struct vwifi_vif *sta;
+    unsigned long updated; /**< last report of the STA (in jiffies) */
 };
 
+static struct vwifi_neigh_entry *vwifi_neigh_alloc(gfp_t gfp)
+{
+    struct vwifi_neigh_entry *ent = kmalloc(sizeof(*ent), gfp);
+
+    if (ent)
+        vwifi_mem_add(VWIFI_MEM_NEIGH, sizeof(*ent));
+    return ent;
+}
+
+static void vwifi_neigh_free(struct vwifi_neigh_entry *ent)
+{
+    vwifi_mem_sub(VWIFI_MEM_NEIGH, sizeof(*ent));
+    kfree(ent);
+}
+
+static struct vwifi_mcast_group *vwifi_mcast_group_alloc(gfp_t gfp)
+{
+    struct vwifi_mcast_group *grp = kmalloc(sizeof(*grp), gfp);
+
+    if (grp)
+        vwifi_mem_add(VWIFI_MEM_MCAST_GROUP, sizeof(*grp));
+    return grp;
+}
+
+static void vwifi_mcast_group_free(struct vwifi_mcast_group *grp)
+{
+    vwifi_mem_sub(VWIFI_MEM_MCAST_GROUP, sizeof(*grp));
+    kfree(grp);
+}
+
+static struct vwifi_mcast_member *vwifi_mcast_member_alloc(gfp_t gfp)
+{
+    struct vwifi_mcast_member *mbr = kmalloc(sizeof(*mbr), gfp);
+
+    if (mbr)
+        vwifi_mem_add(VWIFI_MEM_MCAST_MEMBER, sizeof(*mbr));
+    return mbr;
+}
+
+static void vwifi_mcast_member_free(struct vwifi_mcast_member *mbr)
+{
+    vwifi_mem_sub(VWIFI_MEM_MCAST_MEMBER, sizeof(*mbr));
+    kfree(mbr);
+}
+
+/* ARP payload for Ethernet/IPv4, following struct arphdr */
+struct vwifi_arp_payload {
+    u8 sha[ETH_ALEN];
+    __be32 sip;
+    u8 tha[ETH_ALEN];
+    __be32 tip;
+} __packed;
+
+/* Neighbor advertisement with a target link-layer address option */
+struct vwifi_nd_adv {
+    struct ipv6hdr ip6;
+    struct icmp6hdr icmph;
+    struct in6_addr target;
+    u8 opt_type;
+    u8 opt_len; /**< in units of 8 octets */
+    u8 lladdr[ETH_ALEN];
+} __packed;
+
+/* Offsets in a BOOTP/DHCP message, relative to the UDP payload */
+#define DHCP_YIADDR_OFF 16
+#define DHCP_CHADDR_OFF 28
+#define DHCP_OPTIONS_OFF 240
+#define DHCP_MAGIC_COOKIE 0x63825363
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_MSG_TYPE 53
+#define DHCP_OPT_END 255
+#define DHCP_MSG_ACK 5
+
 /* helper function to retrieve vif from net_device */
 static inline struct vwifi_vif *ndev_get_vwifi_vif(struct net_device *ndev)
 {
@@ -458,331 +1061,2689 @@ static inline s32 rand_int_smooth(s32 low, s32 up, s32 seed)
     return result;
 }
 
-/* Helper function that prepares a structure with self-defined BSS information
- * and "informs" the kernel about the "new" BSS. Most of the code is copied from
- * the upcoming inform_dummy_bss function.
+/* Check whether a BSS with @ssid on @freq is wanted by the scan @req. A scan
+ * without SSIDs (passive) or with the wildcard SSID matches any SSID, and a
+ * scan without channels matches any channel.
  */
-static void inform_bss(struct vwifi_vif *vif)
+static bool vwifi_scan_match(const struct cfg80211_scan_request *req,
+                             const u8 *ssid,
+                             size_t ssid_len,
+                             u32 freq)
 {
-    struct vwifi_vif *ap;
+    bool ssid_match = !req->n_ssids;
+    int i;
 
-    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
-        struct cfg80211_bss *bss = NULL;
-        struct cfg80211_inform_bss data = {
-            /* the only channel */
-            .chan = &ap->wdev.wiphy->bands[NL80211_BAND_2GHZ]->channels[0],
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
-            .scan_width = NL80211_BSS_CHAN_WIDTH_20,
-#endif
-            .signal = DBM_TO_MBM(rand_int_smooth(-100, -30, jiffies)),
-        };
-        int capability = WLAN_CAPABILITY_ESS;
+    for (i = 0; i < req->n_ssids && !ssid_match; i++) {
+        const struct cfg80211_ssid *s = &req->ssids[i];
 
-        if (ap->privacy)
-            capability |= WLAN_CAPABILITY_PRIVACY;
-
-        pr_info("vwifi: %s performs scan, found %s (SSID: %s, BSSID: %pM)\n",
-                vif->ndev->name, ap->ndev->name, ap->ssid, ap->bssid);
-        pr_info("cap = %d, beacon_ie_len = %d\n", capability,
-                ap->beacon_ie_len);
-
-        /* Using the CLOCK_BOOTTIME clock, which remains unaffected by changes
-         * in the system time-of-day clock and includes any time that the
-         * system is suspended.
-         * This clock is suitable for synchronizing the machines in the BSS
-         * using tsf.
-         */
-        u64 tsf = div_u64(ktime_get_boottime_ns(), 1000);
+        ssid_match = !s->ssid_len || (s->ssid_len == ssid_len &&
+                                      !memcmp(s->ssid, ssid, ssid_len));
+    }
 
-        /* It is possible to use cfg80211_inform_bss() instead. */
-        bss = cfg80211_inform_bss_data(
-            vif->wdev.wiphy, &data, CFG80211_BSS_FTYPE_UNKNOWN, ap->bssid, tsf,
-            capability, 100, ap->beacon_ie, ap->beacon_ie_len, GFP_KERNEL);
+    if (!ssid_match)
+        return false;
 
-        /* cfg80211_inform_bss_data() returns cfg80211_bss structure reference
-         * counter of which should be decremented if it is unused.
-         */
-        cfg80211_put_bss(vif->wdev.wiphy, bss);
+    if (!req->n_channels)
+        return true;
+
+    for (i = 0; i < req->n_channels; i++) {
+        if (req->channels[i]->center_freq == freq)
+            return true;
     }
+
+    return false;
 }
 
-static void vwifi_beacon_inform_bss(struct vwifi_vif *ap,
-                                    struct vwifi_vif *sta,
-                                    struct cfg80211_inform_bss *bss_meta,
-                                    int capability,
-                                    u64 tsf)
+/* Check whether @bss, or one of the non-transmitted BSSes it carries, is
+ * wanted by the scan @req.
+ */
+static bool vwifi_scan_bss_match(const struct cfg80211_scan_request *req,
+                                 const struct vwifi_scan_bss *bss,
+                                 u32 freq)
 {
-    struct cfg80211_bss *bss = NULL;
-    bss_meta->signal = DBM_TO_MBM(rand_int_smooth(-100, -30, jiffies));
+    int i;
 
-    /* It is possible to use cfg80211_inform_bss() instead. */
-    bss = cfg80211_inform_bss_data(sta->wdev.wiphy, bss_meta,
-                                   CFG80211_BSS_FTYPE_BEACON, ap->bssid, tsf,
-                                   capability, ap->beacon_int, ap->beacon_ie,
-                                   ap->beacon_ie_len, GFP_KERNEL);
+    if (vwifi_scan_match(req, bss->ssid, bss->ssid_len, freq))
+        return true;
 
-    /* cfg80211_inform_bss_data() returns cfg80211_bss structure reference
-     * counter of which should be decremented if it is unused.
-     */
-    if (bss)
-        cfg80211_put_bss(sta->wdev.wiphy, bss);
+    for (i = 0; i < bss->n_nontx; i++) {
+        if (vwifi_scan_match(req, bss->nontx_ssid[i].ssid,
+                             bss->nontx_ssid[i].ssid_len, freq))
+            return true;
+    }
+
+    return false;
 }
 
-/* The callback function of the beacon timer prepares a structure with
- * custom BSS information and "notifies" the core about the "new"
- * BSS information.
+/* Check whether @bss, or one of the non-transmitted BSSes it carries, has
+ * SSID @ssid.
  */
-static enum hrtimer_restart vwifi_beacon(struct hrtimer *timer)
+static bool vwifi_scan_bss_has_ssid(const struct vwifi_scan_bss *bss,
+                                    const struct cfg80211_ssid *ssid)
 {
-    struct vwifi_vif *vif = container_of(timer, struct vwifi_vif, beacon_timer);
-
-    if (vif->wdev.iftype != NL80211_IFTYPE_AP &&
-        vif->wdev.iftype != NL80211_IFTYPE_MESH_POINT &&
-        vif->wdev.iftype != NL80211_IFTYPE_ADHOC &&
-        vif->wdev.iftype != NL80211_IFTYPE_OCB)
-        return HRTIMER_NORESTART;
+    int i;
 
-    u64 timestamp = div_u64(ktime_get_boottime_ns(), 1000);
+    if (ssid->ssid_len == bss->ssid_len &&
+        !memcmp(ssid->ssid, bss->ssid, bss->ssid_len))
+        return true;
 
-    struct cfg80211_inform_bss bss_meta = {
-        .boottime_ns = ktime_get_boottime_ns(),
-        .chan = vif->channel,
-    };
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
-    switch (vif->bw) {
-    case NL80211_CHAN_WIDTH_5:
-        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_5;
-        break;
-    case NL80211_CHAN_WIDTH_10:
-        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_10;
-        break;
-    default:
-        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_20;
-        break;
+    for (i = 0; i < bss->n_nontx; i++) {
+        if (ssid->ssid_len == bss->nontx_ssid[i].ssid_len &&
+            !memcmp(ssid->ssid, bss->nontx_ssid[i].ssid, ssid->ssid_len))
+            return true;
     }
-#endif
-    int capability = WLAN_CAPABILITY_ESS;
-
-    if (vif->privacy)
-        capability |= WLAN_CAPABILITY_PRIVACY;
-
-    spin_lock(&vif_list_lock);
-    struct vwifi_vif *sta;
-    list_for_each_entry (sta, &vwifi->vif_list, list) {
-        if (sta->wdev.iftype != NL80211_IFTYPE_STATION)
-            continue;
 
-        vwifi_beacon_inform_bss(vif, sta, &bss_meta, capability, timestamp);
-    }
-    spin_unlock(&vif_list_lock);
+    return false;
+}
 
-    /* beacon at next TBTT */
-    u64 tsf, until_tbtt;
-    tsf = ktime_to_us(ktime_get_real());
-    u32 bcn_int = vif->beacon_int;
-    until_tbtt = bcn_int - do_div(tsf, bcn_int);
-    hrtimer_forward_now(&vif->beacon_timer,
-                        ns_to_ktime(until_tbtt * NSEC_PER_USEC));
+/* Center frequency of the channel an AP operates on */
+static u32 vwifi_ap_freq(struct vwifi_vif *ap)
+{
+    if (ap->channel)
+        return ap->channel->center_freq;
 
-    return HRTIMER_RESTART;
+    /* the only channel */
+    return ap->wdev.wiphy->bands[NL80211_BAND_2GHZ]->channels[0].center_freq;
 }
 
-static void vwifi_virtio_fill_vq(struct virtqueue *vq, u8 vnet_hdr_len);
+/* Spatial index of all the vifs, hashed by grid cell. Cells are radio_range
+ * meters wide, so the vifs within range of a vif are found in the 3x3 cells
+ * around its own.
+ */
+static DEFINE_HASHTABLE(vwifi_grid, VWIFI_GRID_HASH_BITS);
+static DEFINE_SPINLOCK(vwifi_grid_lock);
 
-static int vwifi_ndo_open(struct net_device *dev)
+/* Grid cell (along one axis) of position @pos, rounded towards -infinity */
+static s32 vwifi_cell_of(s32 pos)
 {
-    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
+    s64 r = radio_range;
 
-    netif_start_queue(dev);
+    if (!r)
+        return 0;
 
-    vwifi_virtio_fill_vq(vwifi_vqs[VWIFI_VQ_RX], vif->vnet_hdr_len);
+    return div_s64(pos >= 0 ? pos : (s64) pos - r + 1, r);
+}
 
-    return 0;
+static u64 vwifi_cell_key(s32 cell_x, s32 cell_y)
+{
+    return (u64) (u32) cell_x << 32 | (u32) cell_y;
 }
 
-static int vwifi_ndo_stop(struct net_device *dev)
+static bool vwifi_in_range(s32 x1, s32 y1, s32 x2, s32 y2)
 {
-    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
-    struct vwifi_packet *pkt, *is = NULL;
-    list_for_each_entry_safe (pkt, is, &vif->rx_queue, list) {
-        list_del(&pkt->list);
-        kfree(pkt);
-    }
-    netif_stop_queue(dev);
-    return 0;
+    s64 dx = (s64) x1 - x2, dy = (s64) y1 - y2;
+
+    return !radio_range ||
+           dx * dx + dy * dy <= (s64) radio_range * radio_range;
 }
 
-static struct net_device_stats *vwifi_ndo_get_stats(struct net_device *dev)
+static void vwifi_grid_add(struct vwifi_vif *vif)
 {
-    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
-    return &vif->stats;
+    spin_lock_bh(&vwifi_grid_lock);
+    vif->cell_x = vwifi_cell_of(vif->pos_x);
+    vif->cell_y = vwifi_cell_of(vif->pos_y);
+    hash_add(vwifi_grid, &vif->grid_node,
+             vwifi_cell_key(vif->cell_x, vif->cell_y));
+    spin_unlock_bh(&vwifi_grid_lock);
 }
 
-static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
+static void vwifi_grid_del(struct vwifi_vif *vif)
+{
+    spin_lock_bh(&vwifi_grid_lock);
+    hash_del(&vif->grid_node);
+    spin_unlock_bh(&vwifi_grid_lock);
+}
+
+/* Move @vif to (@x, @y). It is only rehashed when it enters another cell. */
+static void vwifi_grid_move(struct vwifi_vif *vif, s32 x, s32 y)
+{
+    s32 cell_x = vwifi_cell_of(x), cell_y = vwifi_cell_of(y);
+
+    spin_lock_bh(&vwifi_grid_lock);
+    vif->pos_x = x;
+    vif->pos_y = y;
+    if (cell_x != vif->cell_x || cell_y != vif->cell_y) {
+        hash_del(&vif->grid_node);
+        vif->cell_x = cell_x;
+        vif->cell_y = cell_y;
+        hash_add(vwifi_grid, &vif->grid_node, vwifi_cell_key(cell_x, cell_y));
+    }
+    spin_unlock_bh(&vwifi_grid_lock);
+}
+
+static int vwifi_scan_bss_cmp(const void *a, const void *b)
+{
+    u64 ca = ((const struct vwifi_scan_bss *) a)->cell;
+    u64 cb = ((const struct vwifi_scan_bss *) b)->cell;
+
+    return ca < cb ? -1 : ca > cb;
+}
+
+/* Capture the report data of every enabled AP. The snapshot is built once per
+ * scan window and shared by all the STAs scanning in it, instead of each of
+ * them walking the AP list. Takes vwifi->lock, so the APs counted are the ones
+ * filled in.
+ */
+static struct vwifi_scan_snap *vwifi_scan_snap_build(void)
+{
+    struct vwifi_scan_snap *snap;
+    struct vwifi_vif *ap;
+    unsigned int n = 0;
+
+    mutex_lock(&vwifi->lock);
+
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list)
+        n++;
+
+    snap = kvmalloc(struct_size(snap, bss, n), GFP_KERNEL);
+    if (!snap) {
+        mutex_unlock(&vwifi->lock);
+        return NULL;
+    }
+
+    kref_init(&snap->ref);
+    /* Using the CLOCK_BOOTTIME clock, which remains unaffected by changes
+     * in the system time-of-day clock and includes any time that the
+     * system is suspended.
+     * This clock is suitable for synchronizing the machines in the BSS
+     * using tsf.
+     */
+    snap->tsf = div_u64(ktime_get_boottime_ns(), 1000);
+    snap->n_bss = 0;
+
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        struct vwifi_scan_bss *bss = &snap->bss[snap->n_bss];
+
+        if (!ap->ap_enabled)
+            continue;
+
+        /* Reported through the Multiple BSSID element of the transmitter */
+        if (ap->mbssid_tx && ap->mbssid_tx != ap)
+            continue;
+
+        spin_lock_bh(&vwifi_grid_lock);
+        bss->x = ap->pos_x;
+        bss->y = ap->pos_y;
+        bss->cell = vwifi_cell_key(ap->cell_x, ap->cell_y);
+        spin_unlock_bh(&vwifi_grid_lock);
+
+        memcpy(bss->bssid, ap->bssid, ETH_ALEN);
+        memcpy(bss->ssid, ap->ssid, ap->ssid_len);
+        bss->ssid_len = ap->ssid_len;
+        bss->freq = vwifi_ap_freq(ap);
+        bss->capability = WLAN_CAPABILITY_ESS;
+        if (ap->privacy)
+            bss->capability |= WLAN_CAPABILITY_PRIVACY;
+        bss->ie_len = ap->beacon_ie_len;
+        memcpy(bss->ie, ap->beacon_ie, ap->beacon_ie_len);
+
+        bss->n_nontx = 0;
+        spin_lock_bh(&vif_list_lock);
+        if (ap->mbssid_tx) {
+            struct vwifi_vif *nontx;
+
+            list_for_each_entry (nontx, &ap->mbssid, mbssid) {
+                struct cfg80211_ssid *ssid = &bss->nontx_ssid[bss->n_nontx];
+
+                if (bss->n_nontx == ARRAY_SIZE(bss->nontx_ssid))
+                    break;
+
+                memcpy(ssid->ssid, nontx->ssid, nontx->ssid_len);
+                ssid->ssid_len = nontx->ssid_len;
+                bss->n_nontx++;
+            }
+        }
+        spin_unlock_bh(&vif_list_lock);
+        bss->hash = jhash(bss->ie, bss->ie_len,
+                          jhash(bss->ssid, bss->ssid_len,
+                                jhash(bss->bssid, ETH_ALEN, 0)));
+
+        snap->n_bss++;
+    }
+
+    mutex_unlock(&vwifi->lock);
+
+    /* Bucket the APs by cell, so each STA only looks at the cells around it */
+    if (radio_range)
+        sort(snap->bss, snap->n_bss, sizeof(snap->bss[0]), vwifi_scan_bss_cmp,
+             NULL);
+
+    return snap;
+}
+
+static void vwifi_scan_snap_free(struct kref *ref)
+{
+    kvfree(container_of(ref, struct vwifi_scan_snap, ref));
+}
+
+static void vwifi_scan_snap_put(struct vwifi_scan_snap *snap)
+{
+    if (snap)
+        kref_put(&snap->ref, vwifi_scan_snap_free);
+}
+
+/* Cursor over the BSSes of a snapshot within range of a STA */
+struct vwifi_scan_iter {
+    s32 x, y, cell_x, cell_y;
+    int cell; /**< next of the 3x3 cells around the STA to look at */
+    unsigned int i, end;
+};
+
+static void vwifi_scan_iter_init(struct vwifi_scan_iter *it,
+                                 struct vwifi_vif *vif)
+{
+    spin_lock_bh(&vwifi_grid_lock);
+    it->x = vif->pos_x;
+    it->y = vif->pos_y;
+    it->cell_x = vif->cell_x;
+    it->cell_y = vif->cell_y;
+    spin_unlock_bh(&vwifi_grid_lock);
+
+    it->cell = 0;
+    it->i = it->end = 0;
+}
+
+/* Return the next BSS of @snap within range of the STA of @it, or NULL. With
+ * a radio range, only the cells around the STA are looked up, by bisecting
+ * the sorted snapshot.
+ */
+static const struct vwifi_scan_bss *vwifi_scan_next(
+    struct vwifi_scan_snap *snap,
+    struct vwifi_scan_iter *it)
+{
+    for (;;) {
+        unsigned int lo, hi;
+        u64 cell;
+
+        while (it->i < it->end) {
+            const struct vwifi_scan_bss *bss = &snap->bss[it->i++];
+
+            if (vwifi_in_range(bss->x, bss->y, it->x, it->y))
+                return bss;
+        }
+
+        if (it->cell == 9)
+            return NULL;
+
+        if (!radio_range) {
+            it->cell = 9;
+            it->i = 0;
+            it->end = snap->n_bss;
+            continue;
+        }
+
+        cell = vwifi_cell_key(it->cell_x + it->cell % 3 - 1,
+                              it->cell_y + it->cell / 3 - 1);
+        it->cell++;
+
+        lo = 0;
+        hi = snap->n_bss;
+        while (lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+
+            if (snap->bss[mid].cell < cell)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        it->i = it->end = lo;
+        while (it->end < snap->n_bss && snap->bss[it->end].cell == cell)
+            it->end++;
+    }
+}
+
+/* Report @bss, operating on @chan, to the wiphy of @vif */
+static void vwifi_inform_bss(struct vwifi_vif *vif,
+                             const struct vwifi_scan_bss *bss,
+                             struct ieee80211_channel *chan,
+                             u64 tsf)
+{
+    struct cfg80211_bss *cbss = NULL;
+    struct cfg80211_inform_bss data = {
+        .chan = chan,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+        .scan_width = NL80211_BSS_CHAN_WIDTH_20,
+#endif
+        .signal = DBM_TO_MBM(rand_int_smooth(-100, -30, jiffies)),
+    };
+
+    pr_debug("vwifi: %s performs scan, found SSID: %.*s, BSSID: %pM\n",
+             vif->ndev->name, (int) bss->ssid_len, bss->ssid, bss->bssid);
+    pr_debug("cap = %d, beacon_ie_len = %d\n", bss->capability, bss->ie_len);
+
+    /* It is possible to use cfg80211_inform_bss() instead. */
+    cbss = cfg80211_inform_bss_data(
+        vif->wdev.wiphy, &data, CFG80211_BSS_FTYPE_UNKNOWN, bss->bssid, tsf,
+        bss->capability, 100, bss->ie, bss->ie_len, GFP_KERNEL);
+
+    /* cfg80211_inform_bss_data() returns cfg80211_bss structure reference
+     * counter of which should be decremented if it is unused.
+     */
+    cfg80211_put_bss(vif->wdev.wiphy, cbss);
+}
+
+/* Helper function that "informs" the kernel about the BSSes captured in
+ * @snap. Only the APs within range, and matching the SSIDs and channels of a
+ * directed scan, are reported.
+ */
+static void inform_bss(struct vwifi_vif *vif, struct vwifi_scan_snap *snap)
+{
+    struct cfg80211_scan_request *req = vif->scan_request;
+    const struct vwifi_scan_bss *bss;
+    struct vwifi_scan_iter it;
+
+    vwifi_scan_iter_init(&it, vif);
+    while ((bss = vwifi_scan_next(snap, &it))) {
+        struct ieee80211_channel *chan;
+
+        /* Report the channel as seen by the scanning wiphy */
+        chan = ieee80211_get_channel(vif->wdev.wiphy, bss->freq);
+        if (!chan)
+            continue;
+
+        if (req && !vwifi_scan_bss_match(req, bss, chan->center_freq))
+            continue;
+
+        vwifi_inform_bss(vif, bss, chan, snap->tsf);
+    }
+}
+
+static void vwifi_beacon_inform_bss(struct vwifi_vif *ap,
+                                    struct vwifi_vif *sta,
+                                    struct cfg80211_inform_bss *bss_meta,
+                                    int capability,
+                                    u64 tsf)
+{
+    struct cfg80211_bss *bss = NULL;
+    bss_meta->signal = DBM_TO_MBM(rand_int_smooth(-100, -30, jiffies));
+
+    /* It is possible to use cfg80211_inform_bss() instead. Called from the
+     * soft hrtimer of the beacon, in softirq context, with the list of the
+     * receivers locked: the allocation must not sleep.
+     */
+    bss = cfg80211_inform_bss_data(sta->wdev.wiphy, bss_meta,
+                                   CFG80211_BSS_FTYPE_BEACON, ap->bssid, tsf,
+                                   capability, ap->beacon_int, ap->beacon_ie,
+                                   ap->beacon_ie_len, GFP_ATOMIC);
+
+    /* cfg80211_inform_bss_data() returns cfg80211_bss structure reference
+     * counter of which should be decremented if it is unused.
+     */
+    if (bss)
+        cfg80211_put_bss(sta->wdev.wiphy, bss);
+}
+
+/* Time (in us) until the next TBTT of @ap */
+static u64 vwifi_until_tbtt(struct vwifi_vif *ap)
+{
+    u64 tsf = ktime_to_us(ktime_get_real());
+    u32 bcn_int = ap->beacon_int;
+
+    return bcn_int - do_div(tsf, bcn_int);
+}
+
+/* The callback function of the beacon timer prepares a structure with
+ * custom BSS information and "notifies" the core about the "new"
+ * BSS information.
+ */
+static enum hrtimer_restart vwifi_beacon(struct hrtimer *timer)
+{
+    struct vwifi_vif *vif = container_of(timer, struct vwifi_vif, beacon_timer);
+
+    if (vif->wdev.iftype != NL80211_IFTYPE_AP &&
+        vif->wdev.iftype != NL80211_IFTYPE_MESH_POINT &&
+        vif->wdev.iftype != NL80211_IFTYPE_ADHOC &&
+        vif->wdev.iftype != NL80211_IFTYPE_OCB)
+        return HRTIMER_NORESTART;
+
+    u64 timestamp = div_u64(ktime_get_boottime_ns(), 1000);
+
+    struct cfg80211_inform_bss bss_meta = {
+        .boottime_ns = ktime_get_boottime_ns(),
+        .chan = vif->channel,
+    };
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+    switch (vif->bw) {
+    case NL80211_CHAN_WIDTH_5:
+        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_5;
+        break;
+    case NL80211_CHAN_WIDTH_10:
+        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_10;
+        break;
+    default:
+        bss_meta.scan_width = NL80211_BSS_CHAN_WIDTH_20;
+        break;
+    }
+#endif
+    int capability = WLAN_CAPABILITY_ESS;
+
+    if (vif->privacy)
+        capability |= WLAN_CAPABILITY_PRIVACY;
+
+    struct vwifi_vif *sta;
+    unsigned int receivers = 0;
+    if (!radio_range) {
+        spin_lock(&vif_list_lock);
+        list_for_each_entry (sta, &vwifi->vif_list, list) {
+            if (sta->wdev.iftype != NL80211_IFTYPE_STATION ||
+                !netif_running(sta->ndev))
+                continue;
+
+            vwifi_beacon_inform_bss(vif, sta, &bss_meta, capability,
+                                    timestamp);
+            receivers++;
+        }
+        spin_unlock(&vif_list_lock);
+    } else {
+        /* Only the STAs in the 3x3 cells around the AP can be in range */
+        spin_lock(&vwifi_grid_lock);
+        for (int i = 0; i < 9; i++) {
+            s32 cell_x = vif->cell_x + i % 3 - 1;
+            s32 cell_y = vif->cell_y + i / 3 - 1;
+
+            hash_for_each_possible (vwifi_grid, sta, grid_node,
+                                    vwifi_cell_key(cell_x, cell_y)) {
+                if (sta->cell_x != cell_x || sta->cell_y != cell_y ||
+                    sta->wdev.iftype != NL80211_IFTYPE_STATION ||
+                    !netif_running(sta->ndev) ||
+                    !vwifi_in_range(vif->pos_x, vif->pos_y, sta->pos_x,
+                                    sta->pos_y))
+                    continue;
+
+                vwifi_beacon_inform_bss(vif, sta, &bss_meta, capability,
+                                        timestamp);
+                receivers++;
+            }
+        }
+        spin_unlock(&vwifi_grid_lock);
+    }
+
+    /* Heard by all the lightweight STAs at once */
+    vif->beacon_count++;
+    receivers += READ_ONCE(vif->n_lsta);
+
+    /* Without receivers, park the timer: beacon at the TBTT closest to
+     * VWIFI_BEACON_PARK_MS from now, until vwifi_beacon_wake() brings it
+     * back. Staying on TBTTs keeps the beacons aligned once resumed.
+     */
+    u64 until_tbtt = vwifi_until_tbtt(vif);
+    vif->beacon_parked = !receivers;
+    if (vif->beacon_parked)
+        until_tbtt += rounddown((u32) (VWIFI_BEACON_PARK_MS * USEC_PER_MSEC),
+                                (u32) vif->beacon_int);
+
+    /* beacon at next TBTT */
+    hrtimer_forward_now(&vif->beacon_timer,
+                        ns_to_ktime(until_tbtt * NSEC_PER_USEC));
+
+    return HRTIMER_RESTART;
+}
+
+/* Resume the beacons of the parked APs at their next TBTT. Called when a STA
+ * may have become a receiver: it went up, started scanning or moved. If the
+ * beacon of an AP is running meanwhile, it already saw the STA.
+ *
+ * Called with vwifi->lock held, so that vwifi_stop_ap() cannot take the AP off
+ * ap_list, and cancel its timer, meanwhile.
+ */
+static void __vwifi_beacon_wake(void)
+{
+    struct vwifi_vif *ap;
+
+    lockdep_assert_held(&vwifi->lock);
+
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        if (!ap->ap_enabled || !READ_ONCE(ap->beacon_parked))
+            continue;
+
+        if (hrtimer_try_to_cancel(&ap->beacon_timer) < 0)
+            continue;
+
+        WRITE_ONCE(ap->beacon_parked, false);
+        hrtimer_start(&ap->beacon_timer,
+                      ns_to_ktime(vwifi_until_tbtt(ap) * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL_SOFT);
+    }
+}
+
+static void vwifi_beacon_wake(void)
+{
+    mutex_lock(&vwifi->lock);
+    __vwifi_beacon_wake();
+    mutex_unlock(&vwifi->lock);
+}
+
+static void vwifi_virtio_fill_vq(struct virtqueue *vq, u8 vnet_hdr_len);
+static void vwifi_edt_flush(struct vwifi_vif *vif);
+
+static int vwifi_ndo_open(struct net_device *dev)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
+
+    netif_start_queue(dev);
+
+    vwifi_virtio_fill_vq(vwifi_vqs[VWIFI_VQ_RX], vif->vnet_hdr_len);
+    vwifi_virtio_fill_vq(vwifi_vqs[VWIFI_VQ_MGMT_RX], vif->vnet_hdr_len);
+
+    /* A new receiver for the parked beacons */
+    if (vif->wdev.iftype == NL80211_IFTYPE_STATION)
+        vwifi_beacon_wake();
+
+    return 0;
+}
+
+/* Queue @pkt to the rx_queue of @vif, or drop it if the queue is full.
+ * Called with vif->lock held. Return true if @pkt was queued.
+ */
+static bool vwifi_rx_enqueue(struct vwifi_vif *vif, struct vwifi_packet *pkt)
+{
+    if (vif->rx_queue_len >= VWIFI_RX_QUEUE_MAX) {
+        vif->stats.rx_dropped++;
+        vwifi_packet_free(pkt);
+        return false;
+    }
+
+    list_add_tail(&pkt->list, &vif->rx_queue);
+    vif->rx_queue_len++;
+    return true;
+}
+
+/* Same for all frames of @list, emptied. Return how many were queued. */
+static unsigned int vwifi_rx_enqueue_list(struct vwifi_vif *vif,
+                                          struct list_head *list)
+{
+    struct vwifi_packet *pkt, *safe;
+    unsigned int n = 0;
+
+    list_for_each_entry_safe (pkt, safe, list, list) {
+        list_del(&pkt->list);
+        n += vwifi_rx_enqueue(vif, pkt);
+    }
+    return n;
+}
+
+static int vwifi_ndo_stop(struct net_device *dev)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
+    struct vwifi_packet *pkt, *is = NULL;
+
+    vwifi_edt_flush(vif);
+    cancel_work_sync(&vif->ws_rx);
+    list_for_each_entry_safe (pkt, is, &vif->rx_queue, list) {
+        list_del(&pkt->list);
+        vwifi_packet_free(pkt);
+    }
+    vif->rx_queue_len = 0;
+    netif_stop_queue(dev);
+    return 0;
+}
+
+static struct net_device_stats *vwifi_ndo_get_stats(struct net_device *dev)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
+    return &vif->stats;
+}
+
+static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
                                         struct net_device *dev);
 
-/* Receive a packet: retrieve, encapsulate it in an skb, and perform the
- * following operations based on the interface mode:
- *   - STA mode: Pass the skb to the upper level (protocol stack).
- *   - AP mode: Perform the following operations based on the packet type:
- *     1. Unicast: If the skb is intended for another STA, pass it to that
- *        STA and do not pass it to the protocol stack. If the skb is intended
- *        for the AP itself, pass it to the protocol stack.
- *     2. Broadcast: Pass the skb to all other STAs except the source STA, and
- *        then pass it to the protocol stack.
- *     3. Multicast: Perform the same operations as for broadcast.
- */
-static void vwifi_rx(struct net_device *dev)
+/* Receive a packet: retrieve, encapsulate it in an skb, and perform the
+ * following operations based on the interface mode:
+ *   - STA mode: Pass the skb to the upper level (protocol stack).
+ *   - AP mode: Perform the following operations based on the packet type:
+ *     1. Unicast: If the skb is intended for another STA, pass it to that
+ *        STA and do not pass it to the protocol stack. If the skb is intended
+ *        for the AP itself, pass it to the protocol stack.
+ *     2. Broadcast: Pass the skb to all other STAs except the source STA, and
+ *        then pass it to the protocol stack.
+ *     3. Multicast: Perform the same operations as for broadcast.
+ */
+static void vwifi_rx(struct net_device *dev)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
+    /* socket buffer will be sended to protocol stack */
+    struct sk_buff *skb;
+    /* socket buffer will be transmitted to another STA */
+    struct sk_buff *skb1 = NULL;
+    struct vwifi_packet *pkt;
+
+    if (mutex_lock_interruptible(&vif->lock))
+        return;
+
+    if (list_empty(&vif->rx_queue)) {
+        mutex_unlock(&vif->lock);
+        pr_info("vwifi rx: No packet in rx_queue\n");
+        return;
+    }
+
+    pkt = list_first_entry(&vif->rx_queue, struct vwifi_packet, list);
+    list_del(&pkt->list);
+    vif->rx_queue_len--;
+
+    vif->stats.rx_packets++;
+    vif->stats.rx_bytes += pkt->datalen;
+    vif->active_time = jiffies;
+
+    mutex_unlock(&vif->lock);
+
+    /* Put raw packet into socket buffer */
+    skb = dev_alloc_skb(pkt->datalen + 2);
+    if (!skb) {
+        pr_info("vwifi rx: low on mem - packet dropped\n");
+        vif->stats.rx_dropped++;
+        goto pkt_free;
+    }
+    skb_reserve(skb, 2); /* align IP address on 16B boundary */
+    memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
+    skb->mark = pkt->mark;
+    skb->priority = pkt->priority;
+
+    vwifi_packet_free(pkt);
+
+    if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
+        struct ethhdr *eth_hdr = (struct ethhdr *) skb->data;
+
+        /* When receiving a multicast/broadcast packet, it is sent to every
+         * STA except the source STA, and then passed to the protocol stack.
+         */
+        if (is_multicast_ether_addr(eth_hdr->h_dest)) {
+            pr_debug("vwifi: is_multicast_ether_addr\n");
+            skb1 = skb_copy(skb, GFP_KERNEL);
+        }
+        /* Receiving a unicast packet */
+        else {
+            /* The packet is not intended for the AP itself. Instead, it is
+             * sent to the destination STA and not passed to the protocol stack.
+             */
+            if (!ether_addr_equal(eth_hdr->h_dest, vif->ndev->dev_addr)) {
+                skb1 = skb;
+                skb = NULL;
+            }
+        }
+
+        if (skb1) {
+            pr_debug("vwifi: AP %s relay:\n", vif->ndev->name);
+            vwifi_ndo_start_xmit(skb1, vif->ndev);
+        }
+
+        /* Nothing to pass to protocol stack */
+        if (!skb)
+            return;
+    }
+
+    /* Pass the skb to protocol stack */
+    skb->dev = dev;
+    skb->protocol = eth_type_trans(skb, dev);
+    skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+    netif_rx_ni(skb);
+#else
+    netif_rx(skb);
+#endif
+
+    return;
+
+pkt_free:
+    vwifi_packet_free(pkt);
+}
+
+/* RX work of an AP. Frames are relayed from here, so the stack depth of a
+ * relay does not depend on the sender, and the budget keeps a broadcast
+ * storm from monopolizing the worker.
+ */
+static void vwifi_rx_work(struct work_struct *w)
+{
+    struct vwifi_vif *vif = container_of(w, struct vwifi_vif, ws_rx);
+
+    for (int budget = VWIFI_RX_BUDGET; budget; budget--) {
+        if (list_empty_careful(&vif->rx_queue))
+            return;
+
+        vwifi_rx(vif->ndev);
+        cond_resched();
+    }
+
+    if (!list_empty_careful(&vif->rx_queue))
+        schedule_work(&vif->ws_rx);
+}
+
+/* Simulate the RX interrupt of @vif after frames were put into its rx_queue.
+ * A STA passes frames straight to the protocol stack, while an AP may relay
+ * them and is thus deferred to its own RX work.
+ */
+static void vwifi_rx_kick(struct vwifi_vif *vif, unsigned int n)
+{
+    if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
+        schedule_work(&vif->ws_rx);
+        return;
+    }
+
+    while (n--)
+        vwifi_rx(vif->ndev);
+}
+
+/* Return the earliest departure time carried by @skb, or 0 if the frame can
+ * be delivered right away.
+ */
+static u64 vwifi_edt_of(const struct sk_buff *skb)
+{
+    u64 edt = ktime_to_ns(skb->tstamp);
+    u64 now;
+
+    if (!edt_pacing || !edt)
+        return 0;
+
+    now = ktime_get_ns();
+
+    /* Already due, or too far ahead to be a departure time (e.g. a
+     * CLOCK_REALTIME receive timestamp left on a forwarded frame).
+     */
+    if (edt <= now || edt - now >= VWIFI_EDT_HORIZON_NS)
+        return 0;
+
+    return edt;
+}
+
+/* Find the earliest EDT held by the wheel. Called with wheel->lock held. */
+static u64 vwifi_edt_next(struct vwifi_edt_wheel *wheel, u64 now)
+{
+    u64 base = now >> VWIFI_EDT_SLOT_SHIFT;
+    u64 next = U64_MAX;
+    struct vwifi_packet *pkt;
+
+    /* Pending frames lie within (now, now + horizon), so slots are ordered
+     * in time starting from the current one. The current slot may also hold
+     * frames almost a full lap ahead, hence it is always inspected together
+     * with the first non-empty slot after it.
+     */
+    for (int i = 0; i < VWIFI_EDT_WHEEL_SLOTS; i++) {
+        struct list_head *slot =
+            &wheel->slots[(base + i) & (VWIFI_EDT_WHEEL_SLOTS - 1)];
+
+        list_for_each_entry (pkt, slot, list)
+            next = min(next, pkt->edt);
+
+        if (i && !list_empty(slot))
+            break;
+    }
+
+    return next;
+}
+
+/* Park @pkt in @vif's wheel until pkt->edt. The hrtimer is only reprogrammed
+ * when the frame becomes the earliest one held by the wheel.
+ */
+static void vwifi_edt_enqueue(struct vwifi_vif *vif, struct vwifi_packet *pkt)
+{
+    struct vwifi_edt_wheel *wheel = &vif->edt;
+    u64 slot = (pkt->edt >> VWIFI_EDT_SLOT_SHIFT) & (VWIFI_EDT_WHEEL_SLOTS - 1);
+
+    spin_lock_bh(&wheel->lock);
+
+    if (!wheel->count)
+        wheel->clk = ktime_get_ns();
+
+    list_add_tail(&pkt->list, &wheel->slots[slot]);
+    wheel->count++;
+
+    if (!hrtimer_is_queued(&wheel->timer) ||
+        pkt->edt < ktime_to_ns(hrtimer_get_expires(&wheel->timer)))
+        hrtimer_start(&wheel->timer, ns_to_ktime(pkt->edt),
+                      HRTIMER_MODE_ABS_SOFT);
+
+    spin_unlock_bh(&wheel->lock);
+}
+
+/* Move every frame whose EDT has passed into rx_queue, deliver them, and
+ * rearm the timer for the next pending frame.
+ */
+static void vwifi_edt_work(struct work_struct *w)
+{
+    struct vwifi_edt_wheel *wheel =
+        container_of(w, struct vwifi_edt_wheel, work);
+    struct vwifi_vif *vif = container_of(wheel, struct vwifi_vif, edt);
+    struct vwifi_packet *pkt, *safe;
+    LIST_HEAD(due);
+    unsigned int ndue = 0;
+    u64 now, base, nslots;
+
+    spin_lock_bh(&wheel->lock);
+
+    now = ktime_get_ns();
+    base = wheel->clk >> VWIFI_EDT_SLOT_SHIFT;
+    /* Visit every slot passed since the last drain, at most one full lap */
+    nslots = min_t(u64, (now >> VWIFI_EDT_SLOT_SHIFT) - base + 1,
+                   VWIFI_EDT_WHEEL_SLOTS);
+
+    for (u64 i = 0; i < nslots; i++) {
+        struct list_head *slot =
+            &wheel->slots[(base + i) & (VWIFI_EDT_WHEEL_SLOTS - 1)];
+
+        list_for_each_entry_safe (pkt, safe, slot, list) {
+            if (pkt->edt > now)
+                continue;
+            list_move_tail(&pkt->list, &due);
+            wheel->count--;
+            ndue++;
+        }
+    }
+    wheel->clk = now;
+
+    if (wheel->count)
+        hrtimer_start(&wheel->timer, ns_to_ktime(vwifi_edt_next(wheel, now)),
+                      HRTIMER_MODE_ABS_SOFT);
+
+    spin_unlock_bh(&wheel->lock);
+
+    if (!ndue)
+        return;
+
+    if (mutex_lock_interruptible(&vif->lock))
+        goto pkt_free;
+
+    ndue = vwifi_rx_enqueue_list(vif, &due);
+
+    mutex_unlock(&vif->lock);
+
+    vwifi_rx_kick(vif, ndue);
+
+    return;
+
+pkt_free:
+    list_for_each_entry_safe (pkt, safe, &due, list) {
+        list_del(&pkt->list);
+        vwifi_packet_free(pkt);
+    }
+}
+
+static enum hrtimer_restart vwifi_edt_timer(struct hrtimer *timer)
+{
+    struct vwifi_edt_wheel *wheel =
+        container_of(timer, struct vwifi_edt_wheel, timer);
+
+    /* vwifi_rx() may sleep, so deliver from process context */
+    schedule_work(&wheel->work);
+
+    return HRTIMER_NORESTART;
+}
+
+static void vwifi_edt_init(struct vwifi_vif *vif)
+{
+    struct vwifi_edt_wheel *wheel = &vif->edt;
+
+    spin_lock_init(&wheel->lock);
+    for (int i = 0; i < VWIFI_EDT_WHEEL_SLOTS; i++)
+        INIT_LIST_HEAD(&wheel->slots[i]);
+    wheel->count = 0;
+    wheel->clk = 0;
+
+    hrtimer_init(&wheel->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    wheel->timer.function = vwifi_edt_timer;
+    INIT_WORK(&wheel->work, vwifi_edt_work);
+}
+
+/* Drop every frame still waiting in @vif's wheel */
+static void vwifi_edt_flush(struct vwifi_vif *vif)
+{
+    struct vwifi_edt_wheel *wheel = &vif->edt;
+    struct vwifi_packet *pkt, *safe;
+
+    hrtimer_cancel(&wheel->timer);
+    cancel_work_sync(&wheel->work);
+
+    spin_lock_bh(&wheel->lock);
+    for (int i = 0; i < VWIFI_EDT_WHEEL_SLOTS; i++) {
+        list_for_each_entry_safe (pkt, safe, &wheel->slots[i], list) {
+            list_del(&pkt->list);
+            vwifi_packet_free(pkt);
+        }
+    }
+    wheel->count = 0;
+    spin_unlock_bh(&wheel->lock);
+}
+
+/* The medium as seen from /dev/vwifi, see vwifi-medium.h. The device is
+ * opened by a single process at a time.
+ */
+struct vwifi_medium {
+    spinlock_t lock; /**< guards the RX ring, the stats and the eventfd */
+    void *ring;      /**< RX ring followed by TX ring */
+    size_t size;
+    u32 frame_size, frame_nr;
+    u32 rx_head; /**< next RX slot to fill */
+    u32 tx_head; /**< next TX slot to send, guarded by vwifi_medium_mutex */
+    struct vwifi_medium_stats stats;
+    struct eventfd_ctx *eventfd;
+    wait_queue_head_t wait;
+    /* Wakes up the reader once per batch of RX frames */
+    struct work_struct notify;
+};
+
+static void vwifi_medium_notify(struct work_struct *w);
+
+static struct vwifi_medium vwifi_medium = {
+    .lock = __SPIN_LOCK_UNLOCKED(vwifi_medium.lock),
+    .wait = __WAIT_QUEUE_HEAD_INITIALIZER(vwifi_medium.wait),
+    .notify = __WORK_INITIALIZER(vwifi_medium.notify, vwifi_medium_notify),
+};
+/* Serializes the setup, the TX and the owner of /dev/vwifi */
+static DEFINE_MUTEX(vwifi_medium_mutex);
+static bool vwifi_medium_busy;
+
+static struct vwifi_medium_desc *vwifi_medium_slot(struct vwifi_medium *m,
+                                                   bool tx,
+                                                   u32 idx)
+{
+    return m->ring + ((size_t) tx * m->frame_nr + idx) * m->frame_size;
+}
+
+static void vwifi_medium_notify(struct work_struct *w)
+{
+    struct vwifi_medium *m = container_of(w, struct vwifi_medium, notify);
+
+    spin_lock_bh(&m->lock);
+    if (m->eventfd)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(m->eventfd);
+#else
+        eventfd_signal(m->eventfd, 1);
+#endif
+    spin_unlock_bh(&m->lock);
+
+    wake_up_interruptible(&m->wait);
+}
+
+/* Copy the frame @src sends to @dst into the RX ring of /dev/vwifi */
+static void vwifi_medium_tap(struct vwifi_vif *src,
+                             struct vwifi_vif *dst,
+                             const u8 *data,
+                             u32 len)
+{
+    struct vwifi_medium *m = &vwifi_medium;
+    struct vwifi_medium_desc *desc;
+    u32 caplen;
+
+    if (!READ_ONCE(m->ring))
+        return;
+
+    spin_lock_bh(&m->lock);
+    if (!m->ring)
+        goto out;
+
+    desc = vwifi_medium_slot(m, false, m->rx_head);
+    if (smp_load_acquire(&desc->status) != VWIFI_MEDIUM_KERNEL) {
+        m->stats.rx_dropped++;
+        goto out;
+    }
+
+    caplen = min_t(u32, len, m->frame_size - VWIFI_MEDIUM_HDRLEN);
+    memcpy((u8 *) desc + VWIFI_MEDIUM_HDRLEN, data, caplen);
+    desc->len = len;
+    desc->caplen = caplen;
+    desc->tstamp_ns = ktime_get_ns();
+    memcpy(desc->src, src->ndev->dev_addr, ETH_ALEN);
+    memcpy(desc->dst, dst->ndev->dev_addr, ETH_ALEN);
+    smp_store_release(&desc->status, VWIFI_MEDIUM_USER);
+
+    m->rx_head = (m->rx_head + 1) & (m->frame_nr - 1);
+    m->stats.rx_frames++;
+    schedule_work(&m->notify);
+
+out:
+    spin_unlock_bh(&m->lock);
+}
+
+/* Get a reference to the net_device of the vif of address @addr */
+static struct net_device *vwifi_medium_find(const u8 *addr)
+{
+    struct net_device *ndev = NULL;
+    struct vwifi_vif *vif;
+
+    spin_lock_bh(&vif_list_lock);
+    list_for_each_entry (vif, &vwifi->vif_list, list) {
+        if (ether_addr_equal(vif->ndev->dev_addr, addr)) {
+            ndev = vif->ndev;
+            dev_hold(ndev);
+            break;
+        }
+    }
+    spin_unlock_bh(&vif_list_lock);
+
+    return ndev;
+}
+
+/* Deliver all the frames userspace marked in the TX ring, and return how many
+ * slots were given back. Called with vwifi_medium_mutex held.
+ */
+static long vwifi_medium_tx(struct vwifi_medium *m)
+{
+    struct vwifi_medium_desc *desc;
+    struct net_device *ndev = NULL;
+    struct vwifi_packet *pkt;
+    struct vwifi_vif *vif;
+    u8 dst[ETH_ALEN];
+    bool queued;
+    u32 caplen;
+    long n = 0;
+
+    for (;;) {
+        desc = vwifi_medium_slot(m, true, m->tx_head);
+        if (smp_load_acquire(&desc->status) != VWIFI_MEDIUM_SEND)
+            break;
+
+        caplen = READ_ONCE(desc->caplen);
+        memcpy(dst, desc->dst, ETH_ALEN);
+
+        /* Consecutive frames usually go to the same vif */
+        if (ndev && !ether_addr_equal(ndev->dev_addr, dst)) {
+            dev_put(ndev);
+            ndev = NULL;
+        }
+        if (!ndev)
+            ndev = vwifi_medium_find(dst);
+
+        pkt = NULL;
+        if (ndev && netif_running(ndev) && caplen >= ETH_HLEN &&
+            caplen <= ETH_DATA_LEN &&
+            caplen <= m->frame_size - VWIFI_MEDIUM_HDRLEN)
+            pkt = vwifi_packet_alloc(GFP_KERNEL);
+
+        if (pkt) {
+            vif = ndev_get_vwifi_vif(ndev);
+            memcpy(pkt->data, (u8 *) desc + VWIFI_MEDIUM_HDRLEN, caplen);
+            pkt->datalen = caplen;
+            pkt->edt = 0;
+            pkt->mark = 0;
+            pkt->priority = 0;
+
+            mutex_lock(&vif->lock);
+            queued = vwifi_rx_enqueue(vif, pkt);
+            mutex_unlock(&vif->lock);
+            if (queued)
+                vwifi_rx_kick(vif, 1);
+        }
+
+        spin_lock_bh(&m->lock);
+        if (pkt)
+            m->stats.tx_frames++;
+        else
+            m->stats.tx_errors++;
+        spin_unlock_bh(&m->lock);
+
+        smp_store_release(&desc->status, VWIFI_MEDIUM_KERNEL);
+        m->tx_head = (m->tx_head + 1) & (m->frame_nr - 1);
+        n++;
+    }
+
+    if (ndev)
+        dev_put(ndev);
+
+    return n;
+}
+
+static int vwifi_medium_setup(struct vwifi_medium *m,
+                              const struct vwifi_medium_req *req)
+{
+    size_t size;
+    void *ring;
+
+    if (req->frame_size % 16 ||
+        req->frame_size < VWIFI_MEDIUM_HDRLEN + ETH_HLEN ||
+        req->frame_size > SZ_64K || !is_power_of_2(req->frame_nr) ||
+        (u64) req->frame_size * req->frame_nr > SZ_64M)
+        return -EINVAL;
+
+    if (m->ring)
+        return -EBUSY;
+
+    size = PAGE_ALIGN((size_t) 2 * req->frame_size * req->frame_nr);
+    ring = vmalloc_user(size);
+    if (!ring)
+        return -ENOMEM;
+
+    spin_lock_bh(&m->lock);
+    m->frame_size = req->frame_size;
+    m->frame_nr = req->frame_nr;
+    m->size = size;
+    m->rx_head = 0;
+    m->tx_head = 0;
+    memset(&m->stats, 0, sizeof(m->stats));
+    WRITE_ONCE(m->ring, ring);
+    spin_unlock_bh(&m->lock);
+
+    return 0;
+}
+
+static int vwifi_medium_set_eventfd(struct vwifi_medium *m, s32 fd)
+{
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_bh(&m->lock);
+    old = m->eventfd;
+    m->eventfd = ctx;
+    spin_unlock_bh(&m->lock);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+static long vwifi_medium_ioctl(struct file *file,
+                               unsigned int cmd,
+                               unsigned long arg)
+{
+    struct vwifi_medium *m = &vwifi_medium;
+    void __user *uarg = (void __user *) arg;
+    struct vwifi_medium_stats stats;
+    struct vwifi_medium_req req;
+    long ret;
+    s32 fd;
+
+    switch (cmd) {
+    case VWIFI_MEDIUM_SETUP:
+        if (copy_from_user(&req, uarg, sizeof(req)))
+            return -EFAULT;
+
+        mutex_lock(&vwifi_medium_mutex);
+        ret = vwifi_medium_setup(m, &req);
+        mutex_unlock(&vwifi_medium_mutex);
+        return ret;
+    case VWIFI_MEDIUM_EVENTFD:
+        if (get_user(fd, (s32 __user *) uarg))
+            return -EFAULT;
+
+        mutex_lock(&vwifi_medium_mutex);
+        ret = vwifi_medium_set_eventfd(m, fd);
+        mutex_unlock(&vwifi_medium_mutex);
+        return ret;
+    case VWIFI_MEDIUM_TX:
+        mutex_lock(&vwifi_medium_mutex);
+        ret = m->ring ? vwifi_medium_tx(m) : -EINVAL;
+        mutex_unlock(&vwifi_medium_mutex);
+        return ret;
+    case VWIFI_MEDIUM_STATS:
+        spin_lock_bh(&m->lock);
+        stats = m->stats;
+        spin_unlock_bh(&m->lock);
+
+        if (copy_to_user(uarg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static int vwifi_medium_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vwifi_medium *m = &vwifi_medium;
+    int ret = -EINVAL;
+
+    mutex_lock(&vwifi_medium_mutex);
+    if (m->ring)
+        ret = remap_vmalloc_range(vma, m->ring, vma->vm_pgoff);
+    mutex_unlock(&vwifi_medium_mutex);
+
+    return ret;
+}
+
+static __poll_t vwifi_medium_poll(struct file *file, poll_table *wait)
+{
+    struct vwifi_medium *m = &vwifi_medium;
+    struct vwifi_medium_desc *desc;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &m->wait, wait);
+
+    /* The last frame filled is still unread */
+    spin_lock_bh(&m->lock);
+    if (m->ring) {
+        desc = vwifi_medium_slot(m, false,
+                                 (m->rx_head - 1) & (m->frame_nr - 1));
+        if (smp_load_acquire(&desc->status) == VWIFI_MEDIUM_USER)
+            mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    spin_unlock_bh(&m->lock);
+
+    return mask;
+}
+
+static int vwifi_medium_open(struct inode *inode, struct file *file)
+{
+    int ret = 0;
+
+    mutex_lock(&vwifi_medium_mutex);
+    if (vwifi_medium_busy)
+        ret = -EBUSY;
+    else
+        vwifi_medium_busy = true;
+    mutex_unlock(&vwifi_medium_mutex);
+
+    return ret;
+}
+
+/* Called once the file and all its mappings are closed */
+static int vwifi_medium_release(struct inode *inode, struct file *file)
+{
+    struct vwifi_medium *m = &vwifi_medium;
+    void *ring;
+
+    mutex_lock(&vwifi_medium_mutex);
+
+    spin_lock_bh(&m->lock);
+    ring = m->ring;
+    WRITE_ONCE(m->ring, NULL);
+    spin_unlock_bh(&m->lock);
+
+    cancel_work_sync(&m->notify);
+    vwifi_medium_set_eventfd(m, -1);
+    vfree(ring);
+    vwifi_medium_busy = false;
+
+    mutex_unlock(&vwifi_medium_mutex);
+
+    return 0;
+}
+
+static const struct file_operations vwifi_medium_fops = {
+    .owner = THIS_MODULE,
+    .open = vwifi_medium_open,
+    .release = vwifi_medium_release,
+    .unlocked_ioctl = vwifi_medium_ioctl,
+    .mmap = vwifi_medium_mmap,
+    .poll = vwifi_medium_poll,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice vwifi_medium_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = KBUILD_MODNAME,
+    .fops = &vwifi_medium_fops,
+    .mode = 0600,
+};
+
+int vwifi_link_verdict(struct vwifi_vif *src,
+                       struct vwifi_vif *dst,
+                       const struct vwifi_link_meta *meta);
+
+/* Link model hook, called for every frame @src sends to @dst. By itself, it
+ * lets every frame through. A BPF program attached to it with fmod_ret (e.g.
+ * SEC("fmod_ret/vwifi_link_verdict")) returns its own verdicts, encoded as
+ * VWIFI_LINK_*, and keeps per-link state in BPF maps. Weak, so that the
+ * compiler does not assume the verdict.
+ */
+__weak noinline int vwifi_link_verdict(struct vwifi_vif *src,
+                                       struct vwifi_vif *dst,
+                                       const struct vwifi_link_meta *meta)
+{
+    return 0;
+}
+ALLOW_ERROR_INJECTION(vwifi_link_verdict, ERRNO);
+
+/* Apply the link model to @pkt on its way from @src to @dst. Return true if
+ * the frame is dropped.
+ */
+static bool vwifi_link_model(struct vwifi_vif *src,
+                             struct vwifi_vif *dst,
+                             struct vwifi_packet *pkt)
+{
+    struct ethhdr *eth = (struct ethhdr *) pkt->data;
+    struct vwifi_link_meta meta = {
+        .len = pkt->datalen,
+        .proto = eth->h_proto,
+        .src_x = src->pos_x,
+        .src_y = src->pos_y,
+        .dst_x = dst->pos_x,
+        .dst_y = dst->pos_y,
+        .now_ns = ktime_get_ns(),
+    };
+    int verdict = vwifi_link_verdict(src, dst, &meta);
+    u32 delay_us;
+
+    pkt->mark = 0;
+    pkt->priority = 0;
+    if (!verdict)
+        return false;
+    if (verdict < 0)
+        return true;
+
+    pkt->priority =
+        (verdict >> VWIFI_LINK_PRIO_SHIFT) & VWIFI_LINK_PRIO_MASK;
+    pkt->mark = (verdict >> VWIFI_LINK_MARK_SHIFT) & VWIFI_LINK_MARK_MASK;
+
+    /* Delayed frames are held by the EDT wheel, like paced ones */
+    delay_us = verdict & VWIFI_LINK_DELAY_MASK;
+    if (delay_us)
+        pkt->edt = max(pkt->edt, meta.now_ns + delay_us * NSEC_PER_USEC);
+
+    return false;
+}
+
+static int __vwifi_ndo_start_xmit(struct vwifi_vif *vif,
+                                  struct vwifi_vif *dest_vif,
+                                  struct sk_buff *skb)
+{
+    struct vwifi_packet *pkt = NULL;
+    struct ethhdr *eth_hdr = (struct ethhdr *) skb->data;
+    int datalen;
+
+    if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
+        pr_debug("vwifi: STA %s (%pM) send packet to AP %s (%pM)\n",
+                 vif->ndev->name, eth_hdr->h_source, dest_vif->ndev->name,
+                 eth_hdr->h_dest);
+    } else if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
+        pr_debug("vwifi: AP %s (%pM) send packet to STA %s (%pM)\n",
+                 vif->ndev->name, eth_hdr->h_source, dest_vif->ndev->name,
+                 eth_hdr->h_dest);
+    }
+
+    pkt = vwifi_packet_alloc(GFP_KERNEL);
+    if (!pkt) {
+        pr_info("Ran out of memory allocating packet pool\n");
+        return NETDEV_TX_OK;
+    }
+    datalen = skb->len;
+    memcpy(pkt->data, skb->data, datalen);
+    pkt->datalen = datalen;
+    pkt->edt = vwifi_edt_of(skb);
+
+    if (vwifi_link_model(vif, dest_vif, pkt))
+        goto error_before_rx_queue;
+
+    vwifi_medium_tap(vif, dest_vif, pkt->data, datalen);
+
+    if (mutex_lock_interruptible(&vif->lock))
+        goto error_before_rx_queue;
+
+    /* Update interface statistics */
+    vif->stats.tx_packets++;
+    vif->stats.tx_bytes += datalen;
+    vif->active_time = jiffies;
+
+    mutex_unlock(&vif->lock);
+
+    /* A paced frame is held by the destination's timer wheel, which passes
+     * it to rx_queue once its departure time is reached.
+     */
+    if (pkt->edt) {
+        vwifi_edt_enqueue(dest_vif, pkt);
+        return datalen;
+    }
+
+    /* enqueue packet to destination vif's rx_queue */
+    if (mutex_lock_interruptible(&dest_vif->lock))
+        goto error_before_rx_queue;
+
+    if (!vwifi_rx_enqueue(dest_vif, pkt)) {
+        mutex_unlock(&dest_vif->lock);
+        return 0;
+    }
+
+    mutex_unlock(&dest_vif->lock);
+
+    if (dest_vif->wdev.iftype == NL80211_IFTYPE_STATION) {
+        pr_debug("vwifi: STA %s (%pM) receive packet from AP %s (%pM)\n",
+                 dest_vif->ndev->name, eth_hdr->h_dest, vif->ndev->name,
+                 eth_hdr->h_source);
+    } else if (dest_vif->wdev.iftype == NL80211_IFTYPE_AP) {
+        pr_debug("vwifi: AP %s (%pM) receive packet from STA %s (%pM)\n",
+                 dest_vif->ndev->name, eth_hdr->h_dest, vif->ndev->name,
+                 eth_hdr->h_source);
+    }
+
+    /* Directly send to rx_queue, simulate the rx interrupt */
+    vwifi_rx_kick(dest_vif, 1);
+
+    return datalen;
+
+error_before_rx_queue:
+    vwifi_packet_free(pkt);
+    return 0;
+}
+
+/* Check whether @sta is still associated to @ap */
+static inline bool vwifi_sta_associated(struct vwifi_vif *ap,
+                                        struct vwifi_vif *sta)
+{
+    return sta->wdev.iftype == NL80211_IFTYPE_STATION && sta->ap == ap &&
+           sta->sme_state == SME_CONNECTED;
+}
+
+/* Find the binding of @addr. Called with ap->neigh_lock held. */
+static struct vwifi_neigh_entry *vwifi_neigh_find(struct vwifi_vif *ap,
+                                                  const struct in6_addr *addr)
+{
+    struct vwifi_neigh_entry *ent;
+
+    hash_for_each_possible (ap->neigh_table, ent, node, ipv6_addr_hash(addr)) {
+        if (ipv6_addr_equal(&ent->addr, addr))
+            return ent;
+    }
+
+    return NULL;
+}
+
+/* Bind @addr to @mac, the address of a member of @ap's BSS */
+static void vwifi_neigh_learn(struct vwifi_vif *ap,
+                              const u8 *mac,
+                              const struct in6_addr *addr)
+{
+    struct vwifi_neigh_entry *ent;
+
+    if (ipv6_addr_any(addr) || ipv6_addr_is_multicast(addr))
+        return;
+
+    spin_lock_bh(&ap->neigh_lock);
+
+    if (!ap->ap_enabled)
+        goto out_unlock;
+
+    ent = vwifi_neigh_find(ap, addr);
+    if (!ent) {
+        if (ap->neigh_num >= VWIFI_NEIGH_MAX)
+            goto out_unlock;
+
+        ent = vwifi_neigh_alloc(GFP_ATOMIC);
+        if (!ent)
+            goto out_unlock;
+
+        ent->addr = *addr;
+        hash_add(ap->neigh_table, &ent->node, ipv6_addr_hash(addr));
+        ap->neigh_num++;
+    }
+
+    memcpy(ent->mac, mac, ETH_ALEN);
+    ent->updated = jiffies;
+
+out_unlock:
+    spin_unlock_bh(&ap->neigh_lock);
+}
+
+/* Look up the MAC address owning @addr into @mac. The binding is only
+ * trusted if it is fresh.
+ */
+static bool vwifi_neigh_lookup(struct vwifi_vif *ap,
+                               const struct in6_addr *addr,
+                               u8 *mac)
+{
+    struct vwifi_neigh_entry *ent;
+    bool found = false;
+
+    spin_lock_bh(&ap->neigh_lock);
+
+    ent = vwifi_neigh_find(ap, addr);
+    if (!ent)
+        goto out_unlock;
+
+    if (time_after(jiffies, ent->updated + VWIFI_NEIGH_TIMEOUT)) {
+        hash_del(&ent->node);
+        vwifi_neigh_free(ent);
+        ap->neigh_num--;
+        goto out_unlock;
+    }
+
+    memcpy(mac, ent->mac, ETH_ALEN);
+    found = true;
+
+out_unlock:
+    spin_unlock_bh(&ap->neigh_lock);
+    return found;
+}
+
+/* Drop the bindings of the STA with address @mac, which leaves @ap's BSS */
+static void vwifi_neigh_forget(struct vwifi_vif *ap, const u8 *mac)
+{
+    struct vwifi_neigh_entry *ent;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock_bh(&ap->neigh_lock);
+    hash_for_each_safe (ap->neigh_table, bkt, tmp, ent, node) {
+        if (!ether_addr_equal(ent->mac, mac))
+            continue;
+        hash_del(&ent->node);
+        vwifi_neigh_free(ent);
+        ap->neigh_num--;
+    }
+    spin_unlock_bh(&ap->neigh_lock);
+}
+
+static void vwifi_neigh_flush(struct vwifi_vif *ap)
+{
+    struct vwifi_neigh_entry *ent;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock_bh(&ap->neigh_lock);
+    hash_for_each_safe (ap->neigh_table, bkt, tmp, ent, node) {
+        hash_del(&ent->node);
+        vwifi_neigh_free(ent);
+    }
+    ap->neigh_num = 0;
+    spin_unlock_bh(&ap->neigh_lock);
+}
+
+static void vwifi_neigh_init(struct vwifi_vif *ap)
+{
+    hash_init(ap->neigh_table);
+    spin_lock_init(&ap->neigh_lock);
+    ap->neigh_num = 0;
+    ap->proxy_arp_suppressed = 0;
+    ap->proxy_arp_flooded = 0;
+    ap->proxy_nd_suppressed = 0;
+    ap->proxy_nd_flooded = 0;
+}
+
+/* Learn the address a DHCP server hands out in a DHCPACK. @off is the offset
+ * of the IPv4 header in @skb.
+ */
+static void vwifi_neigh_snoop_dhcp(struct vwifi_vif *ap,
+                                   struct sk_buff *skb,
+                                   int off)
+{
+    struct iphdr _iph, *iph;
+    struct udphdr _udph, *udph;
+    struct vwifi_vif *sta;
+    struct in6_addr addr;
+    __be32 yiaddr, _cookie, *cookie;
+    u8 chaddr[ETH_ALEN];
+    u8 opt[2];
+    bool ack = false;
+
+    iph = skb_header_pointer(skb, off, sizeof(_iph), &_iph);
+    if (!iph || iph->protocol != IPPROTO_UDP || ip_is_fragment(iph))
+        return;
+
+    off += iph->ihl * 4;
+    udph = skb_header_pointer(skb, off, sizeof(_udph), &_udph);
+    if (!udph || udph->source != htons(67) || udph->dest != htons(68))
+        return;
+
+    off += sizeof(struct udphdr);
+    cookie = skb_header_pointer(skb, off + DHCP_OPTIONS_OFF - 4,
+                                sizeof(_cookie), &_cookie);
+    if (!cookie || *cookie != htonl(DHCP_MAGIC_COOKIE))
+        return;
+
+    /* Walk the options for the message type */
+    for (int i = off + DHCP_OPTIONS_OFF; i < skb->len;) {
+        if (skb_copy_bits(skb, i, opt, 1) || opt[0] == DHCP_OPT_END)
+            return;
+        if (opt[0] == DHCP_OPT_PAD) {
+            i++;
+            continue;
+        }
+        if (skb_copy_bits(skb, i, opt, 2))
+            return;
+        if (opt[0] == DHCP_OPT_MSG_TYPE) {
+            ack = opt[1] == 1 && !skb_copy_bits(skb, i + 2, opt, 1) &&
+                  opt[0] == DHCP_MSG_ACK;
+            break;
+        }
+        i += 2 + opt[1];
+    }
+
+    if (!ack ||
+        skb_copy_bits(skb, off + DHCP_YIADDR_OFF, &yiaddr, sizeof(yiaddr)) ||
+        skb_copy_bits(skb, off + DHCP_CHADDR_OFF, chaddr, ETH_ALEN) ||
+        !yiaddr)
+        return;
+
+    /* Only bind the addresses handed out to members of the BSS */
+    if (mutex_lock_interruptible(&ap->lock))
+        return;
+
+    list_for_each_entry (sta, &ap->bss_list, bss_list) {
+        if (ether_addr_equal(chaddr, sta->ndev->dev_addr)) {
+            ipv6_addr_set_v4mapped(yiaddr, &addr);
+            vwifi_neigh_learn(ap, chaddr, &addr);
+            break;
+        }
+    }
+
+    mutex_unlock(&ap->lock);
+}
+
+/* Learn IP to MAC bindings from a frame relayed by @ap and sent by @src,
+ * which is @ap itself if the frame originates from the AP.
+ */
+static void vwifi_neigh_snoop(struct vwifi_vif *ap,
+                              struct vwifi_vif *src,
+                              struct sk_buff *skb)
+{
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+    struct in6_addr addr;
+
+    if (eth->h_proto == htons(ETH_P_IP)) {
+        vwifi_neigh_snoop_dhcp(ap, skb, ETH_HLEN);
+        return;
+    }
+
+    if (src == ap)
+        return;
+
+    if (eth->h_proto == htons(ETH_P_ARP)) {
+        struct arphdr _arp, *arp;
+        struct vwifi_arp_payload _pl, *pl;
+
+        arp = skb_header_pointer(skb, ETH_HLEN, sizeof(_arp), &_arp);
+        if (!arp || arp->ar_hrd != htons(ARPHRD_ETHER) ||
+            arp->ar_pro != htons(ETH_P_IP) || arp->ar_hln != ETH_ALEN ||
+            arp->ar_pln != 4)
+            return;
+
+        pl = skb_header_pointer(skb, ETH_HLEN + sizeof(_arp), sizeof(_pl),
+                                &_pl);
+        if (!pl || !pl->sip || !ether_addr_equal(pl->sha, eth->h_source))
+            return;
+
+        ipv6_addr_set_v4mapped(pl->sip, &addr);
+        vwifi_neigh_learn(ap, src->ndev->dev_addr, &addr);
+    } else if (eth->h_proto == htons(ETH_P_IPV6)) {
+        struct ipv6hdr _ip6, *ip6;
+        struct nd_msg _msg, *msg;
+
+        ip6 = skb_header_pointer(skb, ETH_HLEN, sizeof(_ip6), &_ip6);
+        if (!ip6 || ip6->nexthdr != IPPROTO_ICMPV6 || ip6->hop_limit != 255)
+            return;
+
+        msg = skb_header_pointer(skb, ETH_HLEN + sizeof(_ip6), sizeof(_msg),
+                                 &_msg);
+        if (!msg || msg->icmph.icmp6_code)
+            return;
+
+        if (msg->icmph.icmp6_type == NDISC_NEIGHBOUR_SOLICITATION)
+            vwifi_neigh_learn(ap, src->ndev->dev_addr, &ip6->saddr);
+        else if (msg->icmph.icmp6_type == NDISC_NEIGHBOUR_ADVERTISEMENT)
+            vwifi_neigh_learn(ap, src->ndev->dev_addr, &msg->target);
+    }
+}
+
+/* Answer an ARP request from @src on behalf of the STA owning the target
+ * address. Return true if the request has been answered and must not be
+ * flooded.
+ */
+static bool vwifi_proxy_arp(struct vwifi_vif *ap,
+                            struct vwifi_vif *src,
+                            struct sk_buff *skb)
+{
+    struct arphdr _arp, *arp;
+    struct vwifi_arp_payload _pl, *pl;
+    struct sk_buff *reply;
+    struct in6_addr addr;
+    u8 mac[ETH_ALEN];
+
+    arp = skb_header_pointer(skb, ETH_HLEN, sizeof(_arp), &_arp);
+    if (!arp || arp->ar_op != htons(ARPOP_REQUEST) ||
+        arp->ar_hrd != htons(ARPHRD_ETHER) || arp->ar_pro != htons(ETH_P_IP) ||
+        arp->ar_hln != ETH_ALEN || arp->ar_pln != 4)
+        return false;
+
+    pl = skb_header_pointer(skb, ETH_HLEN + sizeof(_arp), sizeof(_pl), &_pl);
+    if (!pl)
+        return false;
+
+    /* Leave probes and gratuitous ARP to the owner of the address */
+    if (!pl->sip || pl->sip == pl->tip || ipv4_is_multicast(pl->tip))
+        goto flood;
+
+    ipv6_addr_set_v4mapped(pl->tip, &addr);
+    if (!vwifi_neigh_lookup(ap, &addr, mac) ||
+        ether_addr_equal(mac, pl->sha))
+        goto flood;
+
+    reply = arp_create(ARPOP_REPLY, ETH_P_ARP, pl->sip, ap->ndev, pl->tip,
+                       pl->sha, mac, pl->sha);
+    if (!reply)
+        goto flood;
+
+    __vwifi_ndo_start_xmit(ap, src, reply);
+    dev_kfree_skb(reply);
+
+    spin_lock_bh(&ap->neigh_lock);
+    ap->proxy_arp_suppressed++;
+    spin_unlock_bh(&ap->neigh_lock);
+    return true;
+
+flood:
+    spin_lock_bh(&ap->neigh_lock);
+    ap->proxy_arp_flooded++;
+    spin_unlock_bh(&ap->neigh_lock);
+    return false;
+}
+
+/* Answer a neighbor solicitation from @src on behalf of the STA owning the
+ * target address. Return true if the solicitation has been answered and must
+ * not be flooded.
+ */
+static bool vwifi_proxy_nd(struct vwifi_vif *ap,
+                           struct vwifi_vif *src,
+                           struct sk_buff *skb)
+{
+    struct ipv6hdr _ip6, *ip6;
+    struct nd_msg _msg, *msg;
+    struct vwifi_nd_adv *adv;
+    struct sk_buff *reply;
+    struct ethhdr *eth;
+    u8 mac[ETH_ALEN];
+
+    ip6 = skb_header_pointer(skb, ETH_HLEN, sizeof(_ip6), &_ip6);
+    if (!ip6 || ip6->nexthdr != IPPROTO_ICMPV6 || ip6->hop_limit != 255)
+        return false;
+
+    msg =
+        skb_header_pointer(skb, ETH_HLEN + sizeof(_ip6), sizeof(_msg), &_msg);
+    if (!msg || msg->icmph.icmp6_type != NDISC_NEIGHBOUR_SOLICITATION ||
+        msg->icmph.icmp6_code)
+        return false;
+
+    /* Duplicate address detection is left to the owner of the address */
+    if (ipv6_addr_any(&ip6->saddr) || ipv6_addr_is_multicast(&msg->target))
+        goto flood;
+
+    if (!vwifi_neigh_lookup(ap, &msg->target, mac) ||
+        ether_addr_equal(mac, src->ndev->dev_addr))
+        goto flood;
+
+    reply = dev_alloc_skb(ETH_HLEN + sizeof(struct vwifi_nd_adv));
+    if (!reply)
+        goto flood;
+
+    eth = skb_put(reply, ETH_HLEN);
+    memcpy(eth->h_dest, src->ndev->dev_addr, ETH_ALEN);
+    memcpy(eth->h_source, mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IPV6);
+
+    adv = skb_put_zero(reply, sizeof(struct vwifi_nd_adv));
+    adv->ip6.version = 6;
+    adv->ip6.payload_len =
+        htons(sizeof(struct vwifi_nd_adv) - sizeof(struct ipv6hdr));
+    adv->ip6.nexthdr = IPPROTO_ICMPV6;
+    adv->ip6.hop_limit = 255;
+    adv->ip6.saddr = msg->target;
+    adv->ip6.daddr = ip6->saddr;
+
+    adv->icmph.icmp6_type = NDISC_NEIGHBOUR_ADVERTISEMENT;
+    adv->icmph.icmp6_solicited = 1;
+    adv->target = msg->target;
+    adv->opt_type = ND_OPT_TARGET_LL_ADDR;
+    adv->opt_len = 1;
+    memcpy(adv->lladdr, mac, ETH_ALEN);
+
+    adv->icmph.icmp6_cksum = csum_ipv6_magic(
+        &adv->ip6.saddr, &adv->ip6.daddr, ntohs(adv->ip6.payload_len),
+        IPPROTO_ICMPV6,
+        csum_partial(&adv->icmph, ntohs(adv->ip6.payload_len), 0));
+
+    __vwifi_ndo_start_xmit(ap, src, reply);
+    dev_kfree_skb(reply);
+
+    spin_lock_bh(&ap->neigh_lock);
+    ap->proxy_nd_suppressed++;
+    spin_unlock_bh(&ap->neigh_lock);
+    return true;
+
+flood:
+    spin_lock_bh(&ap->neigh_lock);
+    ap->proxy_nd_flooded++;
+    spin_unlock_bh(&ap->neigh_lock);
+    return false;
+}
+
+/* Proxy ARP/ND entry of the AP relay. Return true if @skb has been answered
+ * on behalf of a STA and must not be delivered further.
+ */
+static bool vwifi_proxy_neigh(struct vwifi_vif *ap,
+                              struct vwifi_vif *src,
+                              struct sk_buff *skb)
+{
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+
+    vwifi_neigh_snoop(ap, src, skb);
+
+    /* Only requests coming from STAs in the BSS are answered */
+    if (src == ap || !is_multicast_ether_addr(eth->h_dest))
+        return false;
+
+    if (eth->h_proto == htons(ETH_P_ARP))
+        return vwifi_proxy_arp(ap, src, skb);
+    if (eth->h_proto == htons(ETH_P_IPV6))
+        return vwifi_proxy_nd(ap, src, skb);
+
+    return false;
+}
+
+/* Find the group of @addr. Called with ap->mcast_lock held. */
+static struct vwifi_mcast_group *vwifi_mcast_find(struct vwifi_vif *ap,
+                                                  const struct in6_addr *addr)
+{
+    struct vwifi_mcast_group *grp;
+
+    hash_for_each_possible (ap->mcast_table, grp, node, ipv6_addr_hash(addr)) {
+        if (ipv6_addr_equal(&grp->addr, addr))
+            return grp;
+    }
+
+    return NULL;
+}
+
+static void vwifi_mcast_join(struct vwifi_vif *ap,
+                             struct vwifi_vif *sta,
+                             const struct in6_addr *addr)
+{
+    struct vwifi_mcast_group *grp;
+    struct vwifi_mcast_member *mbr;
+
+    spin_lock_bh(&ap->mcast_lock);
+
+    if (!ap->ap_enabled)
+        goto out_unlock;
+
+    grp = vwifi_mcast_find(ap, addr);
+    if (!grp) {
+        if (ap->mcast_num >= VWIFI_MCAST_MAX)
+            goto out_unlock;
+
+        grp = vwifi_mcast_group_alloc(GFP_ATOMIC);
+        if (!grp)
+            goto out_unlock;
+
+        grp->addr = *addr;
+        INIT_LIST_HEAD(&grp->members);
+        grp->nr_members = 0;
+        hash_add(ap->mcast_table, &grp->node, ipv6_addr_hash(addr));
+        ap->mcast_num++;
+    }
+
+    list_for_each_entry (mbr, &grp->members, list) {
+        if (mbr->sta == sta) {
+            mbr->updated = jiffies;
+            goto out_unlock;
+        }
+    }
+
+    mbr = vwifi_mcast_member_alloc(GFP_ATOMIC);
+    if (!mbr)
+        goto out_unlock;
+
+    mbr->sta = sta;
+    mbr->updated = jiffies;
+    list_add_tail(&mbr->list, &grp->members);
+    grp->nr_members++;
+
+out_unlock:
+    spin_unlock_bh(&ap->mcast_lock);
+}
+
+/* Remove @grp from @ap once its last member is gone. Called with
+ * ap->mcast_lock held.
+ */
+static void vwifi_mcast_put(struct vwifi_vif *ap, struct vwifi_mcast_group *grp)
+{
+    if (grp->nr_members)
+        return;
+
+    hash_del(&grp->node);
+    vwifi_mcast_group_free(grp);
+    ap->mcast_num--;
+}
+
+static void vwifi_mcast_leave(struct vwifi_vif *ap,
+                              struct vwifi_vif *sta,
+                              const struct in6_addr *addr)
+{
+    struct vwifi_mcast_group *grp;
+    struct vwifi_mcast_member *mbr;
+
+    spin_lock_bh(&ap->mcast_lock);
+
+    grp = vwifi_mcast_find(ap, addr);
+    if (!grp)
+        goto out_unlock;
+
+    list_for_each_entry (mbr, &grp->members, list) {
+        if (mbr->sta == sta) {
+            list_del(&mbr->list);
+            vwifi_mcast_member_free(mbr);
+            grp->nr_members--;
+            vwifi_mcast_put(ap, grp);
+            break;
+        }
+    }
+
+out_unlock:
+    spin_unlock_bh(&ap->mcast_lock);
+}
+
+/* Remove @sta, which leaves @ap's BSS, from all the groups */
+static void vwifi_mcast_forget(struct vwifi_vif *ap, struct vwifi_vif *sta)
+{
+    struct vwifi_mcast_group *grp;
+    struct vwifi_mcast_member *mbr;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock_bh(&ap->mcast_lock);
+    hash_for_each_safe (ap->mcast_table, bkt, tmp, grp, node) {
+        list_for_each_entry (mbr, &grp->members, list) {
+            if (mbr->sta == sta) {
+                list_del(&mbr->list);
+                vwifi_mcast_member_free(mbr);
+                grp->nr_members--;
+                vwifi_mcast_put(ap, grp);
+                break;
+            }
+        }
+    }
+    spin_unlock_bh(&ap->mcast_lock);
+}
+
+static void vwifi_mcast_flush(struct vwifi_vif *ap)
+{
+    struct vwifi_mcast_group *grp;
+    struct vwifi_mcast_member *mbr, *safe;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock_bh(&ap->mcast_lock);
+    hash_for_each_safe (ap->mcast_table, bkt, tmp, grp, node) {
+        list_for_each_entry_safe (mbr, safe, &grp->members, list)
+            vwifi_mcast_member_free(mbr);
+        hash_del(&grp->node);
+        vwifi_mcast_group_free(grp);
+    }
+    ap->mcast_num = 0;
+    spin_unlock_bh(&ap->mcast_lock);
+}
+
+static void vwifi_mcast_init(struct vwifi_vif *ap)
+{
+    hash_init(ap->mcast_table);
+    spin_lock_init(&ap->mcast_lock);
+    ap->mcast_num = 0;
+}
+
+/* Apply an IGMPv3/MLDv2 group record. Both protocols share the record types,
+ * and source filters are not tracked: any interest in a group is a join.
+ */
+static void vwifi_mcast_grec(struct vwifi_vif *ap,
+                             struct vwifi_vif *sta,
+                             const struct in6_addr *addr,
+                             u8 type,
+                             u16 nsrcs)
+{
+    switch (type) {
+    case IGMPV3_MODE_IS_EXCLUDE:
+    case IGMPV3_CHANGE_TO_EXCLUDE:
+        vwifi_mcast_join(ap, sta, addr);
+        break;
+    case IGMPV3_MODE_IS_INCLUDE:
+    case IGMPV3_CHANGE_TO_INCLUDE:
+        if (nsrcs)
+            vwifi_mcast_join(ap, sta, addr);
+        else
+            vwifi_mcast_leave(ap, sta, addr);
+        break;
+    case IGMPV3_ALLOW_NEW_SOURCES:
+        if (nsrcs)
+            vwifi_mcast_join(ap, sta, addr);
+        break;
+    default:
+        break;
+    }
+}
+
+static void vwifi_mcast_snoop_igmp(struct vwifi_vif *ap,
+                                   struct vwifi_vif *sta,
+                                   struct sk_buff *skb)
+{
+    struct iphdr _iph, *iph;
+    struct igmphdr _ih, *ih;
+    struct igmpv3_report _rep, *rep;
+    struct igmpv3_grec _grec, *grec;
+    struct in6_addr addr;
+    int off = ETH_HLEN;
+
+    iph = skb_header_pointer(skb, off, sizeof(_iph), &_iph);
+    if (!iph || iph->protocol != IPPROTO_IGMP || ip_is_fragment(iph))
+        return;
+
+    off += iph->ihl * 4;
+    ih = skb_header_pointer(skb, off, sizeof(_ih), &_ih);
+    if (!ih)
+        return;
+
+    switch (ih->type) {
+    case IGMP_HOST_MEMBERSHIP_REPORT:
+    case IGMPV2_HOST_MEMBERSHIP_REPORT:
+        ipv6_addr_set_v4mapped(ih->group, &addr);
+        vwifi_mcast_join(ap, sta, &addr);
+        break;
+    case IGMP_HOST_LEAVE_MESSAGE:
+        ipv6_addr_set_v4mapped(ih->group, &addr);
+        vwifi_mcast_leave(ap, sta, &addr);
+        break;
+    case IGMPV3_HOST_MEMBERSHIP_REPORT:
+        rep = skb_header_pointer(skb, off, sizeof(_rep), &_rep);
+        if (!rep)
+            return;
+
+        off += sizeof(_rep);
+        for (int i = 0; i < ntohs(rep->ngrec); i++) {
+            grec = skb_header_pointer(skb, off, sizeof(_grec), &_grec);
+            if (!grec)
+                return;
+
+            ipv6_addr_set_v4mapped(grec->grec_mca, &addr);
+            vwifi_mcast_grec(ap, sta, &addr, grec->grec_type,
+                             ntohs(grec->grec_nsrcs));
+
+            off += sizeof(_grec) + ntohs(grec->grec_nsrcs) * sizeof(__be32) +
+                   grec->grec_auxwords * 4;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void vwifi_mcast_snoop_mld(struct vwifi_vif *ap,
+                                  struct vwifi_vif *sta,
+                                  struct sk_buff *skb)
+{
+    struct ipv6hdr _ip6, *ip6;
+    struct icmp6hdr _ih, *ih;
+    struct mld_msg _mld, *mld;
+    struct mld2_grec _grec, *grec;
+    __be16 frag_off;
+    u8 nexthdr;
+    int off;
+
+    ip6 = skb_header_pointer(skb, ETH_HLEN, sizeof(_ip6), &_ip6);
+    if (!ip6)
+        return;
+
+    /* MLD messages follow a hop-by-hop options header */
+    nexthdr = ip6->nexthdr;
+    off = ipv6_skip_exthdr(skb, ETH_HLEN + sizeof(_ip6), &nexthdr, &frag_off);
+    if (off < 0 || nexthdr != IPPROTO_ICMPV6)
+        return;
+
+    ih = skb_header_pointer(skb, off, sizeof(_ih), &_ih);
+    if (!ih)
+        return;
+
+    switch (ih->icmp6_type) {
+    case ICMPV6_MGM_REPORT:
+    case ICMPV6_MGM_REDUCTION:
+        mld = skb_header_pointer(skb, off, sizeof(_mld), &_mld);
+        if (!mld)
+            return;
+
+        if (ih->icmp6_type == ICMPV6_MGM_REPORT)
+            vwifi_mcast_join(ap, sta, &mld->mld_mca);
+        else
+            vwifi_mcast_leave(ap, sta, &mld->mld_mca);
+        break;
+    case ICMPV6_MLD2_REPORT:
+        off += sizeof(_ih);
+        /* The number of group records is the second half of the data */
+        for (int i = 0; i < ntohs(ih->icmp6_dataun.un_data16[1]); i++) {
+            grec = skb_header_pointer(skb, off, sizeof(_grec), &_grec);
+            if (!grec)
+                return;
+
+            vwifi_mcast_grec(ap, sta, &grec->grec_mca, grec->grec_type,
+                             ntohs(grec->grec_nsrcs));
+
+            off += sizeof(_grec) +
+                   ntohs(grec->grec_nsrcs) * sizeof(struct in6_addr) +
+                   grec->grec_auxwords * 4;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Learn group memberships from IGMP/MLD reports sent by @src */
+static void vwifi_mcast_snoop(struct vwifi_vif *ap,
+                              struct vwifi_vif *src,
+                              struct sk_buff *skb)
 {
-    struct vwifi_vif *vif = ndev_get_vwifi_vif(dev);
-    /* socket buffer will be sended to protocol stack */
-    struct sk_buff *skb;
-    /* socket buffer will be transmitted to another STA */
-    struct sk_buff *skb1 = NULL;
-    struct vwifi_packet *pkt;
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
 
-    if (list_empty(&vif->rx_queue)) {
-        pr_info("vwifi rx: No packet in rx_queue\n");
+    if (src == ap || !is_multicast_ether_addr(eth->h_dest))
         return;
+
+    if (eth->h_proto == htons(ETH_P_IP))
+        vwifi_mcast_snoop_igmp(ap, src, skb);
+    else if (eth->h_proto == htons(ETH_P_IPV6))
+        vwifi_mcast_snoop_mld(ap, src, skb);
+}
+
+/* Get the destination group of an IP multicast frame. Link-local control
+ * groups (224.0.0.0/24, ff02::1) are not snooped and always flooded.
+ */
+static bool vwifi_mcast_group_of(struct sk_buff *skb, struct in6_addr *addr)
+{
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+
+    if (eth->h_proto == htons(ETH_P_IP)) {
+        struct iphdr _iph, *iph;
+
+        iph = skb_header_pointer(skb, ETH_HLEN, sizeof(_iph), &_iph);
+        if (!iph || !ipv4_is_multicast(iph->daddr) ||
+            ipv4_is_local_multicast(iph->daddr))
+            return false;
+
+        ipv6_addr_set_v4mapped(iph->daddr, addr);
+        return true;
     }
 
-    if (mutex_lock_interruptible(&vif->lock))
-        goto pkt_free;
+    if (eth->h_proto == htons(ETH_P_IPV6)) {
+        struct ipv6hdr _ip6, *ip6;
 
-    pkt = list_first_entry(&vif->rx_queue, struct vwifi_packet, list);
+        ip6 = skb_header_pointer(skb, ETH_HLEN, sizeof(_ip6), &_ip6);
+        if (!ip6 || !ipv6_addr_is_multicast(&ip6->daddr) ||
+            ipv6_addr_is_ll_all_nodes(&ip6->daddr))
+            return false;
 
-    vif->stats.rx_packets++;
-    vif->stats.rx_bytes += pkt->datalen;
-    vif->active_time = jiffies;
+        *addr = ip6->daddr;
+        return true;
+    }
 
-    mutex_unlock(&vif->lock);
+    return false;
+}
 
-    /* Put raw packet into socket buffer */
-    skb = dev_alloc_skb(pkt->datalen + 2);
-    if (!skb) {
-        pr_info("vwifi rx: low on mem - packet dropped\n");
-        vif->stats.rx_dropped++;
-        goto pkt_free;
+/* Deliver a multicast frame to the STAs subscribed to its group. Return
+ * false if the group is unknown, in which case the frame is flooded.
+ */
+static bool vwifi_mcast_xmit(struct vwifi_vif *ap,
+                             struct vwifi_vif *src,
+                             struct sk_buff *skb,
+                             int *count)
+{
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+    struct vwifi_mcast_group *grp;
+    struct vwifi_mcast_member *mbr, *safe;
+    struct vwifi_vif **dests;
+    struct in6_addr addr;
+    bool to_ucast = mcast_to_ucast;
+    int n = 0;
+
+    if (is_broadcast_ether_addr(eth->h_dest) ||
+        !is_multicast_ether_addr(eth->h_dest) ||
+        !vwifi_mcast_group_of(skb, &addr))
+        return false;
+
+    spin_lock_bh(&ap->mcast_lock);
+
+    grp = vwifi_mcast_find(ap, &addr);
+    if (!grp) {
+        spin_unlock_bh(&ap->mcast_lock);
+        return false;
     }
-    skb_reserve(skb, 2); /* align IP address on 16B boundary */
-    memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
 
-    list_del(&pkt->list);
-    kfree(pkt);
+    /* Snapshot the members, since delivering a frame may sleep */
+    dests = kmalloc_array(grp->nr_members, sizeof(*dests), GFP_ATOMIC);
+    if (!dests) {
+        spin_unlock_bh(&ap->mcast_lock);
+        return false;
+    }
 
-    if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
-        struct ethhdr *eth_hdr = (struct ethhdr *) skb->data;
+    list_for_each_entry_safe (mbr, safe, &grp->members, list) {
+        /* Memberships end with the association, or without reports */
+        if (!vwifi_sta_associated(ap, mbr->sta) ||
+            time_after(jiffies, mbr->updated + VWIFI_MCAST_TIMEOUT)) {
+            list_del(&mbr->list);
+            vwifi_mcast_member_free(mbr);
+            grp->nr_members--;
+            continue;
+        }
+        dests[n++] = mbr->sta;
+    }
+    vwifi_mcast_put(ap, grp);
 
-        /* When receiving a multicast/broadcast packet, it is sent to every
-         * STA except the source STA, and then passed to the protocol stack.
-         */
-        if (is_multicast_ether_addr(eth_hdr->h_dest)) {
-            pr_info("vwifi: is_multicast_ether_addr\n");
-            skb1 = skb_copy(skb, GFP_KERNEL);
+    spin_unlock_bh(&ap->mcast_lock);
+
+    if (!n) {
+        kfree(dests);
+        return false;
+    }
+
+    if (to_ucast && skb_ensure_writable(skb, ETH_HLEN))
+        to_ucast = false;
+
+    for (int i = 0; i < n; i++) {
+        if (dests[i] == src)
+            continue;
+
+        /* Don't send packet from dest_vif's denylist */
+        if (denylist_check(dests[i]->ndev->name, src->ndev->name))
+            continue;
+
+        if (to_ucast) {
+            eth = (struct ethhdr *) skb->data;
+            memcpy(eth->h_dest, dests[i]->ndev->dev_addr, ETH_ALEN);
         }
-        /* Receiving a unicast packet */
-        else {
-            /* The packet is not intended for the AP itself. Instead, it is
-             * sent to the destination STA and not passed to the protocol stack.
-             */
-            if (!ether_addr_equal(eth_hdr->h_dest, vif->ndev->dev_addr)) {
-                skb1 = skb;
-                skb = NULL;
-            }
+
+        if (__vwifi_ndo_start_xmit(ap, dests[i], skb))
+            (*count)++;
+    }
+
+    kfree(dests);
+
+    return true;
+}
+
+/* Lightweight STAs of all APs, by MAC */
+static DEFINE_HASHTABLE(vwifi_lsta_table, VWIFI_LSTA_HASH_BITS);
+static DEFINE_SPINLOCK(vwifi_lsta_lock);
+static atomic_t vwifi_lsta_ids = ATOMIC_INIT(0);
+
+static const char *const vwifi_lsta_models[] = {
+    [VWIFI_LSTA_IDLE] = "idle",
+    [VWIFI_LSTA_CBR] = "cbr",
+    [VWIFI_LSTA_POISSON] = "poisson",
+    [VWIFI_LSTA_ONOFF] = "onoff",
+};
+
+static void vwifi_lsta_work(struct work_struct *w);
+static DECLARE_DELAYED_WORK(vwifi_lsta_dwork, vwifi_lsta_work);
+
+/* Find the lightweight STA of @mac. Called with vwifi_lsta_lock held. */
+static struct vwifi_lsta *vwifi_lsta_find(const u8 *mac)
+{
+    struct vwifi_lsta *lsta;
+
+    hash_for_each_possible (vwifi_lsta_table, lsta, node,
+                            vwifi_mac_to_32(mac)) {
+        if (ether_addr_equal(lsta->mac, mac))
+            return lsta;
+    }
+
+    return NULL;
+}
+
+/* Exponentially distributed delay of mean @mean_ns. -ln(u) of a uniform u in
+ * (0, 1] is derived from a piecewise linear log2, in 16.16 fixed point.
+ */
+static u64 vwifi_exp_ns(u64 mean_ns)
+{
+    u32 r = get_random_u32() | 1;
+    int k = ilog2(r);
+    u32 log2_r = (k << 16) + (u32) (((u64) (r - (1U << k)) << 16) >> k);
+    /* (32 - log2(r)) * ln(2) */
+    u64 neg_ln = ((u64) ((32 << 16) - log2_r) * 45426) >> 16;
+
+    return (mean_ns * neg_ln) >> 16;
+}
+
+/* Return true if @lsta has a frame due at @now, and schedule the next one */
+static bool vwifi_lsta_due(struct vwifi_lsta *lsta, u64 now)
+{
+    u64 gap = NSEC_PER_SEC / lsta->rate;
+
+    if (lsta->model == VWIFI_LSTA_ONOFF) {
+        if (now >= lsta->phase_end) {
+            u32 mean_ms = lsta->on ? lsta->off_ms : lsta->on_ms;
+
+            lsta->on = !lsta->on;
+            lsta->phase_end = now + vwifi_exp_ns((u64) mean_ms * NSEC_PER_MSEC);
+            if (lsta->on)
+                lsta->next_tx = now;
         }
+        if (!lsta->on)
+            return false;
+    }
 
-        if (skb1) {
-            pr_info("vwifi: AP %s relay:\n", vif->ndev->name);
-            vwifi_ndo_start_xmit(skb1, vif->ndev);
+    if (lsta->next_tx > now)
+        return false;
+
+    if (lsta->model == VWIFI_LSTA_POISSON)
+        lsta->next_tx += vwifi_exp_ns(gap);
+    else
+        lsta->next_tx += gap;
+
+    return true;
+}
+
+/* Build the next frame of @lsta, addressed to its AP. The ethertype is the
+ * local experimental one, so the AP's protocol stack silently drops it.
+ */
+static struct vwifi_packet *vwifi_lsta_frame(struct vwifi_lsta *lsta)
+{
+    struct vwifi_packet *pkt;
+    struct ethhdr *eth;
+
+    pkt = vwifi_packet_alloc(GFP_ATOMIC);
+    if (!pkt)
+        return NULL;
+
+    eth = (struct ethhdr *) pkt->data;
+    memcpy(eth->h_dest, lsta->ap->ndev->dev_addr, ETH_ALEN);
+    memcpy(eth->h_source, lsta->mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_802_EX1);
+    memset(eth + 1, 0, lsta->len - ETH_HLEN);
+    pkt->datalen = lsta->len;
+    pkt->edt = 0;
+    pkt->mark = 0;
+    pkt->priority = 0;
+
+    lsta->tx_packets++;
+    lsta->tx_bytes += lsta->len;
+    lsta->active_time = jiffies;
+
+    return pkt;
+}
+
+/* Generate the frames the lightweight STAs of @ap are due to send, and queue
+ * them to the AP in one batch. Return true if one of them has a traffic model.
+ */
+static bool vwifi_lsta_generate(struct vwifi_vif *ap)
+{
+    struct vwifi_lsta *lsta;
+    struct vwifi_packet *pkt;
+    LIST_HEAD(batch);
+    u64 now = ktime_get_ns();
+    unsigned int n = 0;
+    bool busy = false;
+    int burst;
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    list_for_each_entry (lsta, &ap->lsta_list, bss) {
+        if (lsta->model == VWIFI_LSTA_IDLE)
+            continue;
+
+        busy = true;
+        for (burst = 0; burst < VWIFI_LSTA_BURST; burst++) {
+            if (!vwifi_lsta_due(lsta, now))
+                break;
+
+            pkt = vwifi_lsta_frame(lsta);
+            if (!pkt)
+                break;
+            list_add_tail(&pkt->list, &batch);
+            n++;
         }
 
-        /* Nothing to pass to protocol stack */
-        if (!skb)
-            return;
+        /* Fell behind, e.g. the worker was starved: drop the backlog */
+        if (burst == VWIFI_LSTA_BURST && lsta->next_tx <= now)
+            lsta->next_tx = now;
     }
+    spin_unlock_bh(&vwifi_lsta_lock);
 
-    /* Pass the skb to protocol stack */
-    skb->dev = dev;
-    skb->protocol = eth_type_trans(skb, dev);
-    skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
-    netif_rx_ni(skb);
-#else
-    netif_rx(skb);
-#endif
+    if (!n)
+        return busy;
 
-    return;
+    mutex_lock(&ap->lock);
+    n = vwifi_rx_enqueue_list(ap, &batch);
+    mutex_unlock(&ap->lock);
 
-pkt_free:
-    list_del(&pkt->list);
-    kfree(pkt);
+    vwifi_rx_kick(ap, n);
+
+    return busy;
 }
 
-static int __vwifi_ndo_start_xmit(struct vwifi_vif *vif,
-                                  struct vwifi_vif *dest_vif,
-                                  struct sk_buff *skb)
+/* Traffic generator of all lightweight STAs, run every jiffy while one of them
+ * has a traffic model.
+ */
+static void vwifi_lsta_work(struct work_struct *w)
 {
-    struct vwifi_packet *pkt = NULL;
-    struct ethhdr *eth_hdr = (struct ethhdr *) skb->data;
-    int datalen;
+    struct vwifi_vif *ap;
+    bool busy = false;
 
-    if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
-        pr_info("vwifi: STA %s (%pM) send packet to AP %s (%pM)\n",
-                vif->ndev->name, eth_hdr->h_source, dest_vif->ndev->name,
-                eth_hdr->h_dest);
-    } else if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
-        pr_info("vwifi: AP %s (%pM) send packet to STA %s (%pM)\n",
-                vif->ndev->name, eth_hdr->h_source, dest_vif->ndev->name,
-                eth_hdr->h_dest);
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        if (ap->ap_enabled && READ_ONCE(ap->n_lsta))
+            busy |= vwifi_lsta_generate(ap);
     }
+    mutex_unlock(&vwifi->lock);
 
-    pkt = kmalloc(sizeof(struct vwifi_packet), GFP_KERNEL);
-    if (!pkt) {
-        pr_info("Ran out of memory allocating packet pool\n");
-        return NETDEV_TX_OK;
+    if (busy && vwifi->state != VWIFI_SHUTDOWN)
+        queue_delayed_work(system_unbound_wq, &vwifi_lsta_dwork, 1);
+}
+
+/* Whether @ap is still running. Called with vwifi->lock held. */
+static bool vwifi_ap_running(struct vwifi_vif *ap)
+{
+    struct vwifi_vif *pos;
+
+    list_for_each_entry (pos, &vwifi->ap_list, ap_list) {
+        if (pos == ap)
+            return pos->ap_enabled;
     }
-    datalen = skb->len;
-    memcpy(pkt->data, skb->data, datalen);
-    pkt->datalen = datalen;
 
-    /* enqueue packet to destination vif's rx_queue */
-    if (mutex_lock_interruptible(&dest_vif->lock))
-        goto error_before_rx_queue;
+    return false;
+}
 
-    list_add_tail(&pkt->list, &dest_vif->rx_queue);
+/* Associate @count lightweight STAs, configured after @tmpl, to @ap. Called
+ * with vwifi->lock held, which is dropped between batches so that the AP can
+ * stop meanwhile.
+ */
+static int vwifi_lsta_add(struct vwifi_vif *ap,
+                          unsigned int count,
+                          const struct vwifi_lsta *tmpl)
+{
+    struct station_info *sinfo;
+    struct vwifi_lsta *lsta;
+    u8 *ies;
+    u64 gap = tmpl->rate ? NSEC_PER_SEC / tmpl->rate : 0;
+    int ret = 0;
+    u32 id;
 
-    mutex_unlock(&dest_vif->lock);
+    sinfo = kzalloc(sizeof(struct station_info), GFP_KERNEL);
+    if (!sinfo)
+        return -ENOMEM;
 
-    if (mutex_lock_interruptible(&vif->lock))
-        goto erorr_after_rx_queue;
+    /* Associated with the same (faked) request IEs as other STAs. They are
+     * copied so that ap->lock, which the TX path of the AP takes, is not held
+     * across thousands of STAs.
+     */
+    mutex_lock(&ap->lock);
+    ies = kmemdup(ap->beacon_ie, ap->beacon_ie_len, GFP_KERNEL);
+    sinfo->assoc_req_ies_len = ap->beacon_ie_len;
+    mutex_unlock(&ap->lock);
+    if (!ies) {
+        kfree(sinfo);
+        return -ENOMEM;
+    }
+    sinfo->assoc_req_ies = ies;
 
-    /* Update interface statistics */
-    vif->stats.tx_packets++;
-    vif->stats.tx_bytes += datalen;
-    vif->active_time = jiffies;
+    for (unsigned int i = 0; i < count; i++) {
+        if (i && !(i % VWIFI_LSTA_BATCH)) {
+            mutex_unlock(&vwifi->lock);
+            cond_resched();
+            mutex_lock(&vwifi->lock);
 
-    mutex_unlock(&vif->lock);
+            /* Stopped, or even gone, along with the STAs added so far */
+            if (!vwifi_ap_running(ap)) {
+                ret = -ENODEV;
+                break;
+            }
+        }
 
-    if (dest_vif->wdev.iftype == NL80211_IFTYPE_STATION) {
-        pr_info("vwifi: STA %s (%pM) receive packet from AP %s (%pM)\n",
-                dest_vif->ndev->name, eth_hdr->h_dest, vif->ndev->name,
-                eth_hdr->h_source);
-    } else if (dest_vif->wdev.iftype == NL80211_IFTYPE_AP) {
-        pr_info("vwifi: AP %s (%pM) receive packet from STA %s (%pM)\n",
-                dest_vif->ndev->name, eth_hdr->h_dest, vif->ndev->name,
-                eth_hdr->h_source);
+        lsta = kmemdup(tmpl, sizeof(struct vwifi_lsta), GFP_KERNEL);
+        if (!lsta) {
+            ret = -ENOMEM;
+            break;
+        }
+        vwifi_mem_add(VWIFI_MEM_LSTA, sizeof(struct vwifi_lsta));
+
+        /* Locally administered addresses, apart from the vifs' */
+        id = atomic_inc_return(&vwifi_lsta_ids);
+        lsta->mac[0] = 0x02;
+        lsta->mac[1] = 0x6c;
+        lsta->mac[2] = 0x73;
+        lsta->mac[3] = id >> 16;
+        lsta->mac[4] = id >> 8;
+        lsta->mac[5] = id;
+        lsta->ap = ap;
+        lsta->conn_time = lsta->active_time = jiffies;
+        /* Spread the departures of STAs added together */
+        lsta->next_tx =
+            ktime_get_ns() + mul_u64_u32_shr(gap, get_random_u32(), 32);
+
+        spin_lock_bh(&vwifi_lsta_lock);
+        lsta->beacon_base = ap->beacon_count;
+        lsta->bcast_base = ap->lsta_bcast;
+        lsta->bcast_bytes_base = ap->lsta_bcast_bytes;
+        hash_add(vwifi_lsta_table, &lsta->node, vwifi_mac_to_32(lsta->mac));
+        list_add_tail(&lsta->bss, &ap->lsta_list);
+        ap->n_lsta++;
+        ap->lsta_cursor = NULL;
+        spin_unlock_bh(&vwifi_lsta_lock);
+
+        cfg80211_new_sta(ap->ndev, lsta->mac, sinfo, GFP_KERNEL);
+        cond_resched();
     }
 
-    /* Directly send to rx_queue, simulate the rx interrupt */
-    vwifi_rx(dest_vif->ndev);
+    kfree(ies);
+    kfree(sinfo);
 
-    return datalen;
+    if (tmpl->model != VWIFI_LSTA_IDLE)
+        queue_delayed_work(system_unbound_wq, &vwifi_lsta_dwork, 1);
+    /* New receivers for the beacons, vwifi->lock is held by the caller */
+    __vwifi_beacon_wake();
 
-erorr_after_rx_queue:
-    list_del(&pkt->list);
-error_before_rx_queue:
-    kfree(pkt);
-    return 0;
+    return ret;
+}
+
+/* Disassociate and free all lightweight STAs of @ap */
+static void vwifi_lsta_flush(struct vwifi_vif *ap)
+{
+    struct vwifi_lsta *lsta, *safe;
+    LIST_HEAD(gone);
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    list_for_each_entry (lsta, &ap->lsta_list, bss)
+        hash_del(&lsta->node);
+    list_splice_init(&ap->lsta_list, &gone);
+    ap->n_lsta = 0;
+    ap->lsta_cursor = NULL;
+    spin_unlock_bh(&vwifi_lsta_lock);
+
+    list_for_each_entry_safe (lsta, safe, &gone, bss) {
+        if (vwifi->state != VWIFI_SHUTDOWN)
+            cfg80211_del_sta(ap->ndev, lsta->mac, GFP_KERNEL);
+        vwifi_mem_sub(VWIFI_MEM_LSTA, sizeof(struct vwifi_lsta));
+        kfree(lsta);
+    }
+}
+
+/* Sink a frame @ap sends to its lightweight STAs. Return true if one of them,
+ * or all of them for a group addressed frame, received it.
+ */
+static bool vwifi_lsta_rx(struct vwifi_vif *ap, struct sk_buff *skb)
+{
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+    struct vwifi_lsta *lsta;
+    bool ret = false;
+
+    if (!ap->ap_enabled || !READ_ONCE(ap->n_lsta))
+        return false;
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    if (is_multicast_ether_addr(eth->h_dest)) {
+        ap->lsta_bcast++;
+        ap->lsta_bcast_bytes += skb->len;
+        ret = true;
+    } else {
+        lsta = vwifi_lsta_find(eth->h_dest);
+        if (lsta && lsta->ap == ap) {
+            lsta->rx_packets++;
+            lsta->rx_bytes += skb->len;
+            lsta->active_time = jiffies;
+            ret = true;
+        }
+    }
+    spin_unlock_bh(&vwifi_lsta_lock);
+
+    return ret;
+}
+
+/* Fill @sinfo for the lightweight STA @mac of @ap */
+static int vwifi_lsta_get_station(struct vwifi_vif *ap,
+                                  const u8 *mac,
+                                  struct station_info *sinfo)
+{
+    struct vwifi_lsta *lsta;
+    int ret = -ENONET;
+
+    if (!ap->ap_enabled)
+        return ret;
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    lsta = vwifi_lsta_find(mac);
+    if (lsta && lsta->ap == ap) {
+        sinfo->filled = BIT_ULL(NL80211_STA_INFO_TX_PACKETS) |
+                        BIT_ULL(NL80211_STA_INFO_RX_PACKETS) |
+                        BIT_ULL(NL80211_STA_INFO_TX_BYTES) |
+                        BIT_ULL(NL80211_STA_INFO_RX_BYTES) |
+                        BIT_ULL(NL80211_STA_INFO_SIGNAL) |
+                        BIT_ULL(NL80211_STA_INFO_INACTIVE_TIME) |
+                        BIT_ULL(NL80211_STA_INFO_CONNECTED_TIME) |
+                        BIT_ULL(NL80211_STA_INFO_BEACON_RX);
+        /* From the STA's point of view, as for the other STAs */
+        sinfo->tx_packets = lsta->tx_packets;
+        sinfo->tx_bytes = lsta->tx_bytes;
+        sinfo->rx_packets =
+            lsta->rx_packets + ap->lsta_bcast - lsta->bcast_base;
+        sinfo->rx_bytes =
+            lsta->rx_bytes + ap->lsta_bcast_bytes - lsta->bcast_bytes_base;
+        sinfo->rx_beacon = ap->beacon_count - lsta->beacon_base;
+        sinfo->signal = rand_int_smooth(-100, -30, jiffies);
+        sinfo->inactive_time = jiffies_to_msecs(jiffies - lsta->active_time);
+        sinfo->connected_time =
+            jiffies_to_msecs(jiffies - lsta->conn_time) / 1000;
+        ret = 0;
+    }
+    spin_unlock_bh(&vwifi_lsta_lock);
+
+    return ret;
+}
+
+/* Get the MAC of the @idx-th lightweight STA of @ap for a station dump. A dump
+ * walks the STAs in order, so the walk resumes from the previous one.
+ */
+static int vwifi_lsta_dump(struct vwifi_vif *ap, int idx, u8 *mac)
+{
+    struct vwifi_lsta *lsta;
+    int ret = -ENONET;
+    int i = 0;
+
+    if (!ap->ap_enabled)
+        return ret;
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    lsta = ap->lsta_cursor;
+    if (lsta && ap->lsta_cursor_idx <= idx)
+        i = ap->lsta_cursor_idx;
+    else
+        lsta = list_first_entry(&ap->lsta_list, struct vwifi_lsta, bss);
+
+    list_for_each_entry_from (lsta, &ap->lsta_list, bss) {
+        if (i == idx) {
+            memcpy(mac, lsta->mac, ETH_ALEN);
+            ap->lsta_cursor = lsta;
+            ap->lsta_cursor_idx = idx;
+            ret = 0;
+            break;
+        }
+        i++;
+    }
+    spin_unlock_bh(&vwifi_lsta_lock);
+
+    return ret;
 }
 
 static netdev_tx_t vwifi_virtio_tx(struct vwifi_vif *vif, struct sk_buff *skb);
@@ -812,11 +3773,16 @@ static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
 
     /* TX by interface of STA mode */
     if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
-        if (vif->ap && vif->ap->ap_enabled) {
-            dest_vif = vif->ap;
+        /* Cleared by the AP stopping, from another thread */
+        struct vwifi_vif *ap = READ_ONCE(vif->ap);
 
-            if (__vwifi_ndo_start_xmit(vif, dest_vif, skb))
+        if (ap && ap->ap_enabled) {
+            dest_vif = ap;
+
+            if (__vwifi_ndo_start_xmit(vif, dest_vif, skb)) {
+                WRITE_ONCE(vif->tx_time, jiffies);
                 count++;
+            }
         }
     }
     /* TX by interface of AP mode */
@@ -828,8 +3794,19 @@ static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
                 break;
         }
 
-        /* Check if the packet is broadcasting */
-        if (is_broadcast_ether_addr(eth_hdr->h_dest)) {
+        if (mcast_snooping)
+            vwifi_mcast_snoop(vif, src_vif, skb);
+
+        /* Answered by the AP on behalf of the STA owning the address */
+        if (READ_ONCE(vif->proxy_arp) &&
+            vwifi_proxy_neigh(vif, src_vif, skb))
+            count++;
+        else if (mcast_snooping &&
+                 vwifi_mcast_xmit(vif, src_vif, skb, &count)) {
+            /* Multicast delivered to the subscribers of a known group */
+        }
+        /* Check if the packet is broadcasting or multicasting */
+        else if (is_multicast_ether_addr(eth_hdr->h_dest)) {
             list_for_each_entry (dest_vif, &vif->bss_list, bss_list) {
                 /* Don't send broadcast packet back to the source interface.
                  */
@@ -844,6 +3821,9 @@ static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
                 if (__vwifi_ndo_start_xmit(vif, dest_vif, skb))
                     count++;
             }
+
+            if (vwifi_lsta_rx(vif, skb))
+                count++;
         }
         /* The packet is unicasting */
         else {
@@ -857,6 +3837,10 @@ static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
                     break;
                 }
             }
+
+            /* Not a STA with a net_device, maybe a lightweight one */
+            if (dest_vif == vif && vwifi_lsta_rx(vif, skb))
+                count++;
         }
     }
 
@@ -866,7 +3850,20 @@ static netdev_tx_t vwifi_ndo_start_xmit(struct sk_buff *skb,
     /* Don't forget to cleanup skb, as its ownership moved to xmit callback. */
     dev_kfree_skb(skb);
 
-    return NETDEV_TX_OK;
+    return NETDEV_TX_OK;
+}
+
+/* Called with the address lock held, so the RX filter of the virtio device
+ * is programmed from a work.
+ */
+static void vwifi_ndo_set_rx_mode(struct net_device *dev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&vwifi_virtio_lock, flags);
+    if (vwifi_virtio_enabled)
+        schedule_work(&vwifi_virtio_rx_mode);
+    spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 }
 
 /* Structure of functions for network devices.
@@ -878,6 +3875,7 @@ static struct net_device_ops vwifi_ndev_ops = {
     .ndo_stop = vwifi_ndo_stop,
     .ndo_start_xmit = vwifi_ndo_start_xmit,
     .ndo_get_stats = vwifi_ndo_get_stats,
+    .ndo_set_rx_mode = vwifi_ndo_set_rx_mode,
 };
 
 /* Inform the "dummy" BSS to kernel and call cfg80211_scan_done() to finish
@@ -886,6 +3884,7 @@ static struct net_device_ops vwifi_ndev_ops = {
 static void vwifi_scan_timeout_work(struct work_struct *w)
 {
     struct vwifi_vif *vif = container_of(w, struct vwifi_vif, ws_scan_timeout);
+    struct vwifi_scan_snap *snap = xchg(&vif->scan_snap, NULL);
     struct cfg80211_scan_info info = {
         /* if scan was aborted by user (calling cfg80211_ops->abort_scan) or by
          * any driver/hardware issue - field should be set to "true"
@@ -893,17 +3892,39 @@ static void vwifi_scan_timeout_work(struct work_struct *w)
         .aborted = false,
     };
 
+    /* The scan may already be completed, e.g. when a virtio scan completed
+     * early and the timer fired again.
+     */
+    if (!vif->scan_request) {
+        vwifi_scan_snap_put(snap);
+        return;
+    }
+
+    /* Scans not served by a scan window capture the APs on their own */
+    if (!snap)
+        snap = vwifi_scan_snap_build();
+
     /* inform with dummy BSS */
-    inform_bss(vif);
+    if (snap)
+        inform_bss(vif, snap);
+    vwifi_scan_snap_put(snap);
 
     if (mutex_lock_interruptible(&vif->lock))
         return;
 
+    if (!vif->scan_request)
+        goto out;
+
     /* finish scan */
     cfg80211_scan_done(vif->scan_request, &info);
 
     vif->scan_request = NULL;
 
+    /* Responses expected from the next wildcard scan over virtio */
+    if (vif->scan_wildcard)
+        vif->scan_known_aps = vif->scan_resps;
+
+out:
     mutex_unlock(&vif->lock);
 }
 
@@ -919,6 +3940,46 @@ static void vwifi_scan_timeout(struct timer_list *t)
         schedule_work(&vif->ws_scan_timeout);
 }
 
+/* STAs whose scan waits for the scan window to close. The window opens with the
+ * first scan queued and lasts SCAN_TIMEOUT_MS, then all the waiting STAs are
+ * served from a single AP snapshot.
+ */
+static LIST_HEAD(vwifi_scan_batch);
+static DEFINE_SPINLOCK(vwifi_scan_batch_lock);
+
+/* Close the scan window: capture the APs once, then complete the scans of the
+ * waiting STAs from the snapshot, spread over the online CPUs.
+ */
+static void vwifi_scan_batch_work(struct work_struct *w)
+{
+    struct vwifi_scan_snap *snap = vwifi_scan_snap_build();
+    struct vwifi_vif *vif, *safe;
+    int cpu = -1;
+
+    spin_lock_bh(&vwifi_scan_batch_lock);
+
+    list_for_each_entry_safe (vif, safe, &vwifi_scan_batch, scan_batch) {
+        list_del_init(&vif->scan_batch);
+
+        /* Without a snapshot, each STA captures the APs on its own */
+        if (snap) {
+            kref_get(&snap->ref);
+            vif->scan_snap = snap;
+        }
+
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+        queue_work_on(cpu, system_wq, &vif->ws_scan_timeout);
+    }
+
+    spin_unlock_bh(&vwifi_scan_batch_lock);
+
+    vwifi_scan_snap_put(snap);
+}
+
+static DECLARE_DELAYED_WORK(vwifi_scan_batch_dwork, vwifi_scan_batch_work);
+
 static void vwifi_virtio_scan_request(struct vwifi_vif *vif);
 
 /* Scan routine. It simulates a fake BSS scan (in fact, it does nothing) and
@@ -944,12 +4005,17 @@ static void vwifi_scan_routine(struct work_struct *w)
 
     /* In a real-world driver, BSS scanning would occur here. However, in the
      * case of viwifi, scanning is not performed because dummy BSS entries are
-     * already stored in the SSID hash table. Instead, a scan timeout is set
-     * after a specific number of jiffies. The timeout worker informs the
-     * kernel about the "dummy" BSS and calls cfg80211_scan_done() to complete
-     * the scan.
+     * already stored in the SSID hash table. Instead, the STA joins the
+     * current scan window, which closes SCAN_TIMEOUT_MS after it opened. The
+     * timeout worker then informs the kernel about the "dummy" BSS and calls
+     * cfg80211_scan_done() to complete the scan.
      */
-    mod_timer(&vif->scan_timeout, jiffies + msecs_to_jiffies(SCAN_TIMEOUT_MS));
+    spin_lock_bh(&vwifi_scan_batch_lock);
+    list_add_tail(&vif->scan_batch, &vwifi_scan_batch);
+    /* No-op if the window is already open */
+    queue_delayed_work(system_wq, &vwifi_scan_batch_dwork,
+                       msecs_to_jiffies(SCAN_TIMEOUT_MS));
+    spin_unlock_bh(&vwifi_scan_batch_lock);
 }
 
 static void vwifi_virtio_connect_request(struct vwifi_vif *vif);
@@ -976,7 +4042,7 @@ static void vwifi_connect_routine(struct work_struct *w)
 
     /* Finding the AP by request SSID */
     list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
-        if (!memcmp(ap->ssid, vif->req_ssid, ap->ssid_len)) {
+        if (ap->ap_enabled && !memcmp(ap->ssid, vif->req_ssid, ap->ssid_len)) {
             pr_info("vwifi: %s is connected to AP %s (SSID: %s, BSSID: %pM)\n",
                     vif->ndev->name, ap->ndev->name, ap->ssid, ap->bssid);
 
@@ -1014,7 +4080,7 @@ static void vwifi_connect_routine(struct work_struct *w)
             memcpy(vif->bssid, ap->bssid, ETH_ALEN);
             vif->sme_state = SME_CONNECTED;
             vif->conn_time = jiffies;
-            vif->ap = ap;
+            WRITE_ONCE(vif->ap, ap);
 
             mutex_unlock(&vif->lock);
 
@@ -1035,6 +4101,30 @@ static void vwifi_connect_routine(struct work_struct *w)
 
 static void vwifi_virtio_disconnect(struct vwifi_vif *vif);
 
+/* Take @vif off the BSS of its AP, along with what the AP learned about it.
+ * Called with vif->lock held.
+ */
+static void vwifi_sta_leave_bss(struct vwifi_vif *vif)
+{
+    struct vwifi_vif *ap = vif->ap;
+
+    /* The AP took the STA off its BSS when it stopped */
+    if (vwifi->state == VWIFI_SHUTDOWN || !ap)
+        return;
+
+    mutex_lock(&ap->lock);
+    if (ap->ap_enabled && !list_empty(&vif->bss_list)) {
+        cfg80211_del_sta(ap->ndev, vif->ndev->dev_addr, GFP_KERNEL);
+        list_del_init(&vif->bss_list);
+    }
+    mutex_unlock(&ap->lock);
+
+    vwifi_neigh_forget(ap, vif->ndev->dev_addr);
+    vwifi_mcast_forget(ap, vif);
+
+    WRITE_ONCE(vif->ap, NULL);
+}
+
 /* Invoke cfg80211_disconnected() that informs the kernel that disconnect is
  * complete. Overall disconnect may call cfg80211_connect_timeout() if
  * disconnect interrupting connection routine, but for this module let's keep
@@ -1056,12 +4146,14 @@ static void vwifi_disconnect_routine(struct work_struct *w)
 
     spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 
-    pr_info("vwifi: %s disconnected from AP %s\n", vif->ndev->name,
-            vif->ap->ndev->name);
-
     if (mutex_lock_interruptible(&vif->lock))
         return;
 
+    /* No AP when it stopped, and already took the STA off its BSS */
+    if (vif->ap)
+        pr_info("vwifi: %s disconnected from AP %s\n", vif->ndev->name,
+                vif->ap->ndev->name);
+
     /* STA cleanup stuff */
     cfg80211_disconnected(vif->ndev, vif->disconnect_reason_code, NULL, 0, true,
                           GFP_KERNEL);
@@ -1070,21 +4162,7 @@ static void vwifi_disconnect_routine(struct work_struct *w)
     vif->sme_state = SME_DISCONNECTED;
 
     /* AP cleanup stuff */
-    if (vwifi->state != VWIFI_SHUTDOWN) {
-        if (mutex_lock_interruptible(&vif->ap->lock)) {
-            mutex_unlock(&vif->lock);
-            return;
-        }
-
-        if (vif->ap->ap_enabled && !list_empty(&vif->bss_list)) {
-            cfg80211_del_sta(vif->ap->ndev, vif->ndev->dev_addr, GFP_KERNEL);
-            list_del(&vif->bss_list);
-        }
-
-        mutex_unlock(&vif->ap->lock);
-
-        vif->ap = NULL;
-    }
+    vwifi_sta_leave_bss(vif);
 
     mutex_unlock(&vif->lock);
 }
@@ -1114,11 +4192,226 @@ static int vwifi_scan(struct wiphy *wiphy,
 
     mutex_unlock(&vif->lock);
 
+    vwifi_beacon_wake();
+
     if (!schedule_work(&vif->ws_scan))
         return -EBUSY;
     return 0;
 }
 
+/* Scheduled scans of all STAs are run by a single delayed work, so that idle
+ * STAs do not each wake up the system, nor userspace, on their own schedule.
+ */
+static LIST_HEAD(vwifi_sched_scan_list);
+static DEFINE_MUTEX(vwifi_sched_scan_lock);
+
+/* Return the channel of @bss on the wiphy of @vif if @bss is wanted by the
+ * scheduled scan of @vif, i.e. it operates on a scanned channel and its SSID
+ * is in one of the match sets. Return NULL otherwise.
+ */
+static struct ieee80211_channel *vwifi_sched_scan_match(
+    struct vwifi_vif *vif,
+    const struct vwifi_scan_bss *bss)
+{
+    struct cfg80211_sched_scan_request *req = vif->sched_scan_req;
+    struct ieee80211_channel *chan;
+    int i;
+
+    chan = ieee80211_get_channel(vif->wdev.wiphy, bss->freq);
+    if (!chan)
+        return NULL;
+
+    for (i = 0; i < req->n_channels; i++) {
+        if (req->channels[i]->center_freq == chan->center_freq)
+            break;
+    }
+    if (req->n_channels && i == req->n_channels)
+        return NULL;
+
+    /* Without match sets, every BSS is reported */
+    if (!req->n_match_sets)
+        return chan;
+
+    for (i = 0; i < req->n_match_sets; i++) {
+        const struct cfg80211_ssid *ssid = &req->match_sets[i].ssid;
+
+        if (!ssid->ssid_len || vwifi_scan_bss_has_ssid(bss, ssid))
+            return chan;
+    }
+
+    return NULL;
+}
+
+/* Run one pass of the scheduled scan of @vif against @snap. Userspace is only
+ * notified when the matching BSSes, or their IEs, changed since the last pass.
+ */
+static void vwifi_sched_scan_run(struct vwifi_vif *vif,
+                                 struct vwifi_scan_snap *snap)
+{
+    const struct vwifi_scan_bss *bss;
+    struct vwifi_scan_iter it;
+    u32 sig = 0;
+
+    /* Summed, so the signature does not depend on the order of APs */
+    vwifi_scan_iter_init(&it, vif);
+    while ((bss = vwifi_scan_next(snap, &it))) {
+        if (vwifi_sched_scan_match(vif, bss))
+            sig += bss->hash;
+    }
+
+    if (sig == vif->sched_scan_sig)
+        return;
+    vif->sched_scan_sig = sig;
+
+    vwifi_scan_iter_init(&it, vif);
+    while ((bss = vwifi_scan_next(snap, &it))) {
+        struct ieee80211_channel *chan = vwifi_sched_scan_match(vif, bss);
+
+        if (chan)
+            vwifi_inform_bss(vif, bss, chan, snap->tsf);
+    }
+
+    cfg80211_sched_scan_results(vif->wdev.wiphy, vif->sched_scan_req->reqid);
+}
+
+/* Move the scheduled scan of @vif to its next pass, following its scan plans.
+ * The last plan has no iteration limit.
+ */
+static void vwifi_sched_scan_advance(struct vwifi_vif *vif)
+{
+    struct cfg80211_sched_scan_request *req = vif->sched_scan_req;
+    struct cfg80211_sched_scan_plan *plan;
+
+    plan = &req->scan_plans[vif->sched_scan_plan];
+
+    if (plan->iterations && ++vif->sched_scan_iter >= plan->iterations &&
+        vif->sched_scan_plan + 1 < req->n_scan_plans) {
+        plan = &req->scan_plans[++vif->sched_scan_plan];
+        vif->sched_scan_iter = 0;
+    }
+
+    vif->sched_scan_next = jiffies + plan->interval * HZ;
+}
+
+static void vwifi_sched_scan_work(struct work_struct *w);
+static DECLARE_DELAYED_WORK(vwifi_sched_scan_dwork, vwifi_sched_scan_work);
+
+/* Arm the shared work for the earliest pending pass. The delay is rounded up
+ * to a whole second, so that passes falling due close together are batched.
+ * Called with vwifi_sched_scan_lock held.
+ */
+static void vwifi_sched_scan_arm(void)
+{
+    struct vwifi_vif *vif;
+    unsigned long next = 0;
+    bool pending = false;
+
+    list_for_each_entry (vif, &vwifi_sched_scan_list, sched_scan_list) {
+        if (!pending || time_before(vif->sched_scan_next, next))
+            next = vif->sched_scan_next;
+        pending = true;
+    }
+
+    if (!pending)
+        return;
+
+    mod_delayed_work(system_power_efficient_wq, &vwifi_sched_scan_dwork,
+                     round_jiffies_up_relative(
+                         time_after(next, jiffies) ? next - jiffies : 0));
+}
+
+static void vwifi_sched_scan_work(struct work_struct *w)
+{
+    struct vwifi_scan_snap *snap = NULL;
+    struct vwifi_vif *vif;
+
+    mutex_lock(&vwifi_sched_scan_lock);
+
+    list_for_each_entry (vif, &vwifi_sched_scan_list, sched_scan_list) {
+        if (time_before(jiffies, vif->sched_scan_next))
+            continue;
+
+        /* Shared by all the passes falling due in this run */
+        if (!snap)
+            snap = vwifi_scan_snap_build();
+        if (snap)
+            vwifi_sched_scan_run(vif, snap);
+        vwifi_sched_scan_advance(vif);
+    }
+
+    vwifi_sched_scan_arm();
+
+    mutex_unlock(&vwifi_sched_scan_lock);
+
+    vwifi_scan_snap_put(snap);
+}
+
+/* Called by the kernel when userspace offloads its background scans. Instead
+ * of a work and a timer per STA, the STA joins the list served by the shared
+ * scheduled scan work.
+ */
+static int vwifi_sched_scan_start(struct wiphy *wiphy,
+                                  struct net_device *ndev,
+                                  struct cfg80211_sched_scan_request *request)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(ndev);
+    unsigned long flags;
+
+    if (vif->wdev.iftype != NL80211_IFTYPE_STATION)
+        return -EPERM;
+
+    /* With virtio, the BSSes are only known by asking the other side */
+    spin_lock_irqsave(&vwifi_virtio_lock, flags);
+    if (vwifi_virtio_enabled) {
+        spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+        return -EOPNOTSUPP;
+    }
+    spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+
+    mutex_lock(&vwifi_sched_scan_lock);
+
+    if (vif->sched_scan_req) {
+        mutex_unlock(&vwifi_sched_scan_lock);
+        return -EBUSY;
+    }
+
+    vif->sched_scan_req = request;
+    vif->sched_scan_plan = 0;
+    vif->sched_scan_iter = 0;
+    vif->sched_scan_sig = 0;
+    vif->sched_scan_next = jiffies + request->delay * HZ;
+    list_add_tail(&vif->sched_scan_list, &vwifi_sched_scan_list);
+
+    vwifi_sched_scan_arm();
+
+    mutex_unlock(&vwifi_sched_scan_lock);
+
+    vwifi_beacon_wake();
+
+    return 0;
+}
+
+/* Called by the kernel to stop a scheduled scan. The request is freed by
+ * cfg80211 once this returns, so it must be off the list by then.
+ */
+static int vwifi_sched_scan_stop(struct wiphy *wiphy,
+                                 struct net_device *ndev,
+                                 u64 reqid)
+{
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(ndev);
+
+    mutex_lock(&vwifi_sched_scan_lock);
+
+    if (vif->sched_scan_req) {
+        list_del(&vif->sched_scan_list);
+        vif->sched_scan_req = NULL;
+    }
+
+    mutex_unlock(&vwifi_sched_scan_lock);
+
+    return 0;
+}
+
 /* callback called by the kernel when there is need to "connect" to some
  * network. It initializes connection routine through work_struct and exits
  * with 0 if everything is ok. connect routine should be finished with
@@ -1216,6 +4509,8 @@ static int vwifi_get_station(struct wiphy *wiphy,
         }
         if (!memcmp(mac, sta_vif->ndev->dev_addr, ETH_ALEN))
             found_sta = true;
+        if (!found_sta)
+            return vwifi_lsta_get_station(vif, mac, sinfo);
         break;
     case NL80211_IFTYPE_STATION:
         if (!memcmp(mac, vif->bssid, ETH_ALEN))
@@ -1240,19 +4535,20 @@ static int vwifi_get_station(struct wiphy *wiphy,
                     BIT_ULL(NL80211_STA_INFO_RX_BITRATE) |
                     BIT_ULL(NL80211_STA_INFO_TX_BITRATE);
 
-    if (vif->sme_state == SME_CONNECTED) {
+    struct vwifi_vif *ap = READ_ONCE(vif->ap);
+
+    if (vif->sme_state == SME_CONNECTED && ap) {
         sinfo->filled |= BIT_ULL(NL80211_STA_INFO_CONNECTED_TIME);
         sinfo->connected_time =
             jiffies_to_msecs(jiffies - vif->conn_time) / 1000;
 
-        if (mutex_lock_interruptible(&vif->ap->lock))
+        if (mutex_lock_interruptible(&ap->lock))
             return -ENONET;
 
-        sinfo->bss_param.beacon_interval =
-            cpu_to_le16(vif->ap->beacon_int / 1024);
+        sinfo->bss_param.beacon_interval = cpu_to_le16(ap->beacon_int / 1024);
         sinfo->bss_param.dtim_period = 1;
 
-        mutex_unlock(&vif->ap->lock);
+        mutex_unlock(&ap->lock);
         sinfo->bss_param.flags |= BSS_PARAM_FLAGS_SHORT_PREAMBLE;
     }
 
@@ -1304,7 +4600,7 @@ static int vwifi_dump_station(struct wiphy *wiphy,
 {
     struct vwifi_vif *ap_vif = ndev_get_vwifi_vif(dev);
 
-    pr_info("Dump station at the idx %d\n", idx);
+    pr_debug("Dump station at the idx %d\n", idx);
 
     int ret = -ENONET;
     struct vwifi_vif *sta_vif = NULL;
@@ -1318,8 +4614,12 @@ static int vwifi_dump_station(struct wiphy *wiphy,
         break;
     }
 
-    if (sta_vif == ap_vif)
-        return ret;
+    /* Then come the lightweight STAs */
+    if (sta_vif == ap_vif) {
+        if (vwifi_lsta_dump(ap_vif, idx - i, mac))
+            return ret;
+        return vwifi_lsta_get_station(ap_vif, mac, sinfo);
+    }
 
     ret = 0;
 
@@ -1329,21 +4629,21 @@ static int vwifi_dump_station(struct wiphy *wiphy,
 
 static void vwifi_virtio_scan_complete(struct timer_list *t);
 
-/* Create a virtual interface that has its own wiphy, not shared with other
- * interfaces. The interface mode is set to STA mode. To change the interface
- * type, use the change_virtual_intf() function.
- */
-static struct wireless_dev *vwifi_interface_add(struct wiphy *wiphy, int if_idx)
+/* Allocate the net_device of a new interface of type @type on @wiphy */
+static struct vwifi_vif *vwifi_vif_alloc(struct wiphy *wiphy,
+                                         const char *name,
+                                         unsigned char name_assign_type,
+                                         enum nl80211_iftype type)
 {
     struct net_device *ndev = NULL;
     struct vwifi_vif *vif = NULL;
 
     /* allocate network device context. */
-    ndev = alloc_netdev(sizeof(struct vwifi_vif), NDEV_NAME, NET_NAME_ENUM,
+    ndev = alloc_netdev(sizeof(struct vwifi_vif), name, name_assign_type,
                         ether_setup);
 
     if (!ndev)
-        goto error_alloc_ndev;
+        return NULL;
 
     /* fill private data of network context. */
     vif = ndev_get_vwifi_vif(ndev);
@@ -1355,7 +4655,7 @@ static struct wireless_dev *vwifi_interface_add(struct wiphy *wiphy, int if_idx)
      */
     vif->wdev.wiphy = wiphy;
     vif->wdev.netdev = ndev;
-    vif->wdev.iftype = NL80211_IFTYPE_STATION;
+    vif->wdev.iftype = type;
     vif->ndev->ieee80211_ptr = &vif->wdev;
 
     /* set network device hooks. should implement ndo_start_xmit() at least */
@@ -1364,6 +4664,78 @@ static struct wireless_dev *vwifi_interface_add(struct wiphy *wiphy, int if_idx)
     /* Add here proper net_device initialization */
     vif->ndev->features |= NETIF_F_HW_CSUM;
 
+    return vif;
+}
+
+/* Initialize the state of a registered interface and make it visible to the
+ * rest of the driver.
+ */
+static void vwifi_vif_setup(struct vwifi_vif *vif)
+{
+    vwifi_mem_add(VWIFI_MEM_VIF, sizeof(struct vwifi_vif));
+
+    /* Initialize connection information */
+    memset(vif->bssid, 0, ETH_ALEN);
+    memset(vif->ssid, 0, IEEE80211_MAX_SSID_LEN);
+    memset(vif->req_ssid, 0, IEEE80211_MAX_SSID_LEN);
+    vif->scan_request = NULL;
+    vif->sme_state = SME_DISCONNECTED;
+    vif->conn_time = 0;
+    vif->active_time = 0;
+    vif->disconnect_reason_code = 0;
+    WRITE_ONCE(vif->ap, NULL);
+    vif->bss_sta_table_entry_num = 0;
+
+    mutex_init(&vif->lock);
+    mutex_init(&vif->bss_sta_table_lock);
+
+    /* Initialize timer of scan_timeout */
+    timer_setup(&vif->scan_timeout, vwifi_scan_timeout, 0);
+    timer_setup(&vif->scan_complete, vwifi_virtio_scan_complete, 0);
+
+    INIT_WORK(&vif->ws_connect, vwifi_connect_routine);
+    INIT_WORK(&vif->ws_disconnect, vwifi_disconnect_routine);
+    INIT_WORK(&vif->ws_scan, vwifi_scan_routine);
+    INIT_WORK(&vif->ws_scan_timeout, vwifi_scan_timeout_work);
+    INIT_LIST_HEAD(&vif->scan_batch);
+
+    /* Initialize rx_queue */
+    INIT_LIST_HEAD(&vif->rx_queue);
+    vif->rx_queue_len = 0;
+    vwifi_edt_init(vif);
+    INIT_WORK(&vif->ws_rx, vwifi_rx_work);
+
+    hash_init(vif->bss_sta_table);
+    hash_init(vif->ie_cache);
+    vif->ie_cache_num = 0;
+    vif->ie_cache_seq = 0;
+    /* Not to match the IEs cached before a reload */
+    vif->beacon_ie_gen = get_random_u32();
+
+    /* Add vif into global vif_list */
+    spin_lock_bh(&vif_list_lock);
+    list_add_tail(&vif->list, &vwifi->vif_list);
+    spin_unlock_bh(&vif_list_lock);
+
+    INIT_LIST_HEAD(&vif->mbssid);
+
+    /* Every vif starts at the origin, until moved through debugfs */
+    vwifi_grid_add(vif);
+}
+
+/* Create a virtual interface that has its own wiphy, not shared with other
+ * interfaces. The interface mode is set to STA mode. To change the interface
+ * type, use the change_virtual_intf() function.
+ */
+static struct wireless_dev *vwifi_interface_add(struct wiphy *wiphy, int if_idx)
+{
+    struct vwifi_vif *vif;
+
+    vif = vwifi_vif_alloc(wiphy, NDEV_NAME, NET_NAME_ENUM,
+                          NL80211_IFTYPE_STATION);
+    if (!vif)
+        goto error_alloc_ndev;
+
     /* The first byte is '\0' to avoid being a multicast
      * address (the first byte of multicast addrs is odd).
      */
@@ -1385,48 +4757,124 @@ static struct wireless_dev *vwifi_interface_add(struct wiphy *wiphy, int if_idx)
     if (register_netdev(vif->ndev))
         goto error_ndev_register;
 
-    /* Initialize connection information */
-    memset(vif->bssid, 0, ETH_ALEN);
-    memset(vif->ssid, 0, IEEE80211_MAX_SSID_LEN);
-    memset(vif->req_ssid, 0, IEEE80211_MAX_SSID_LEN);
-    vif->scan_request = NULL;
-    vif->sme_state = SME_DISCONNECTED;
-    vif->conn_time = 0;
-    vif->active_time = 0;
-    vif->disconnect_reason_code = 0;
-    vif->ap = NULL;
-    vif->bss_sta_table_entry_num = 0;
+    vwifi_vif_setup(vif);
 
-    mutex_init(&vif->lock);
-    mutex_init(&vif->bss_sta_table_lock);
+    return &vif->wdev;
+
+error_ndev_register:
+    free_netdev(vif->ndev);
+error_alloc_ndev:
+    wiphy_unregister(wiphy);
+    wiphy_free(wiphy);
+    return NULL;
+}
+
+/* Called by the kernel when the user adds an interface on top of the wiphy of
+ * an existing one, e.g. hostapd running several BSSes on one radio. Only AP
+ * interfaces can share a radio, as the BSSes of a multi-BSSID AP.
+ */
+static struct wireless_dev *vwifi_add_virtual_intf(
+    struct wiphy *wiphy,
+    const char *name,
+    unsigned char name_assign_type,
+    enum nl80211_iftype type,
+    struct vif_params *params)
+{
+    struct wireless_dev *wdev;
+    struct vwifi_vif *vif, *primary = NULL;
+    unsigned long used = 0;
+    u8 addr[ETH_ALEN];
+    int n = 0, off;
+
+    if (type != NL80211_IFTYPE_AP)
+        return ERR_PTR(-EOPNOTSUPP);
+
+    list_for_each_entry (wdev, &wiphy->wdev_list, list) {
+        if (!wdev_get_vwifi_vif(wdev)->secondary)
+            primary = wdev_get_vwifi_vif(wdev);
+        n++;
+    }
+    if (!primary)
+        return ERR_PTR(-ENODEV);
+    /* The BSSes share the radio of an AP, not of a STA */
+    if (primary->wdev.iftype != NL80211_IFTYPE_AP)
+        return ERR_PTR(-EOPNOTSUPP);
+    if (n >= VWIFI_MBSSID_MAX)
+        return ERR_PTR(-ENOSPC);
+
+    /* Offsets from the radio address taken by the other BSSes */
+    list_for_each_entry (wdev, &wiphy->wdev_list, list) {
+        off = (u8) (wdev->netdev->dev_addr[ETH_ALEN - 1] -
+                    primary->ndev->dev_addr[ETH_ALEN - 1]);
+        if (off < VWIFI_MBSSID_MAX)
+            __set_bit(off, &used);
+    }
+
+    vif = vwifi_vif_alloc(wiphy, name, name_assign_type, type);
+    if (!vif)
+        return ERR_PTR(-ENOMEM);
+    vif->secondary = true;
+
+    /* Unless requested, derive the address from the one of the radio */
+    if (is_valid_ether_addr(params->macaddr)) {
+        ether_addr_copy(addr, params->macaddr);
+    } else {
+        ether_addr_copy(addr, primary->ndev->dev_addr);
+        addr[ETH_ALEN - 1] += find_first_zero_bit(&used, VWIFI_MBSSID_MAX);
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+    eth_hw_addr_set(vif->ndev, addr);
+#else
+    memcpy(vif->ndev->dev_addr, addr, ETH_ALEN);
+#endif
+
+    /* Called with rtnl, and the wiphy lock since 5.12, held */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    if (cfg80211_register_netdevice(vif->ndev)) {
+#else
+    if (register_netdevice(vif->ndev)) {
+#endif
+        free_netdev(vif->ndev);
+        return ERR_PTR(-ENODEV);
+    }
+
+    vwifi_vif_setup(vif);
+
+    return &vif->wdev;
+}
 
-    /* Initialize timer of scan_timeout */
-    timer_setup(&vif->scan_timeout, vwifi_scan_timeout, 0);
-    timer_setup(&vif->scan_complete, vwifi_virtio_scan_complete, 0);
+static int vwifi_vif_teardown(struct vwifi_vif *vif);
 
-    INIT_WORK(&vif->ws_connect, vwifi_connect_routine);
-    INIT_WORK(&vif->ws_disconnect, vwifi_disconnect_routine);
-    INIT_WORK(&vif->ws_scan, vwifi_scan_routine);
-    INIT_WORK(&vif->ws_scan_timeout, vwifi_scan_timeout_work);
+/* Called by the kernel when the user deletes an interface added through
+ * vwifi_add_virtual_intf(). The interfaces owning a wiphy live as long as the
+ * module.
+ */
+static int vwifi_del_virtual_intf(struct wiphy *wiphy,
+                                  struct wireless_dev *wdev)
+{
+    struct vwifi_vif *vif = wdev_get_vwifi_vif(wdev);
+    int ret;
 
-    /* Initialize rx_queue */
-    INIT_LIST_HEAD(&vif->rx_queue);
+    if (!vif->secondary)
+        return -EOPNOTSUPP;
 
-    hash_init(vif->bss_sta_table);
+    ret = vwifi_vif_teardown(vif);
+    if (ret)
+        return ret;
 
-    /* Add vif into global vif_list */
     spin_lock_bh(&vif_list_lock);
-    list_add_tail(&vif->list, &vwifi->vif_list);
+    list_del(&vif->list);
     spin_unlock_bh(&vif_list_lock);
 
-    return &vif->wdev;
+    /* Called with rtnl held, the net_device is freed once unregistered */
+    vif->ndev->needs_free_netdev = true;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    cfg80211_unregister_netdevice(vif->ndev);
+#else
+    unregister_netdevice(vif->ndev);
+#endif
 
-error_ndev_register:
-    free_netdev(vif->ndev);
-error_alloc_ndev:
-    wiphy_unregister(wiphy);
-    wiphy_free(wiphy);
-    return NULL;
+    return 0;
 }
 
 /* Called by kernel when user decided to change the interface type. */
@@ -1435,9 +4883,15 @@ static int vwifi_change_iface(struct wiphy *wiphy,
                               enum nl80211_iftype type,
                               struct vif_params *params)
 {
+    struct vwifi_vif *vif = ndev_get_vwifi_vif(ndev);
+
     switch (type) {
     case NL80211_IFTYPE_STATION:
     case NL80211_IFTYPE_AP:
+        /* Shares a union with the STA state, until vwifi_start_ap() */
+        if (type == NL80211_IFTYPE_AP &&
+            vif->wdev.iftype != NL80211_IFTYPE_AP)
+            vif->ap_enabled = false;
         ndev->ieee80211_ptr->iftype = type;
         break;
     default:
@@ -1448,6 +4902,179 @@ static int vwifi_change_iface(struct wiphy *wiphy,
     return 0;
 }
 
+/* Store the beacon IEs of @beacon in vif->beacon_ie. cfg80211 and some upper
+ * user-space programs treat IEs as two-part:
+ * 1. head: 802.11 beacon frame header + beacon IEs before TIM IE
+ * 2. tail: beacon IEs after TIM IE
+ * We combine them, followed by the Multiple BSSID elements describing the
+ * non-transmitted BSSes when @vif is a transmitting BSS.
+ */
+static int vwifi_set_beacon_ies(struct vwifi_vif *vif,
+                                const struct cfg80211_beacon_data *beacon)
+{
+    int ie_offset = DOT11_MGMT_HDR_LEN + DOT11_BCN_PRB_FIXED_LEN;
+    int head_ie_len = beacon->head_len - ie_offset;
+    int tail_ie_len = beacon->tail_len;
+    int mbssid_ie_len = 0;
+    u8 *pos;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    for (int i = 0; beacon->mbssid_ies && i < beacon->mbssid_ies->cnt; i++)
+        mbssid_ie_len += beacon->mbssid_ies->elem[i].len;
+#endif
+
+    if (unlikely(head_ie_len + tail_ie_len + mbssid_ie_len > IE_MAX_LEN)) {
+        pr_info("%s: IE exceed %d bytes!\n", __func__, IE_MAX_LEN);
+        return -EINVAL;
+    }
+
+    vif->beacon_ie_len = head_ie_len + tail_ie_len + mbssid_ie_len;
+    vif->beacon_ie_gen++;
+    memset(vif->beacon_ie, 0, IE_MAX_LEN);
+    memcpy(vif->beacon_ie, &beacon->head[ie_offset], head_ie_len);
+    memcpy(vif->beacon_ie + head_ie_len, beacon->tail, tail_ie_len);
+
+    pos = vif->beacon_ie + head_ie_len + tail_ie_len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    for (int i = 0; beacon->mbssid_ies && i < beacon->mbssid_ies->cnt; i++) {
+        memcpy(pos, beacon->mbssid_ies->elem[i].data,
+               beacon->mbssid_ies->elem[i].len);
+        pos += beacon->mbssid_ies->elem[i].len;
+    }
+#endif
+
+    pr_info(
+        "%s: head_ie_len (before TIM IE) = %d, tail_ie_len = %d, "
+        "mbssid_ie_len = %d",
+        __func__, head_ie_len, tail_ie_len, mbssid_ie_len);
+
+    return 0;
+}
+
+/* Take @vif out of its multi-BSSID set. When @vif is the transmitting BSS, the
+ * non-transmitted BSSes lose their beacons until they are restarted.
+ */
+static void vwifi_mbssid_leave(struct vwifi_vif *vif)
+{
+    struct vwifi_vif *pos, *safe;
+
+    spin_lock_bh(&vif_list_lock);
+    if (vif->mbssid_tx == vif) {
+        list_for_each_entry_safe (pos, safe, &vif->mbssid, mbssid) {
+            list_del_init(&pos->mbssid);
+            pos->mbssid_tx = NULL;
+        }
+    } else {
+        list_del_init(&vif->mbssid);
+    }
+    vif->mbssid_tx = NULL;
+    spin_unlock_bh(&vif_list_lock);
+}
+
+static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif,
+                                       const u8 *dest,
+                                       u16 reason);
+static void vwifi_virtio_sta_entry_response(struct vwifi_vif *vif,
+                                            enum VWIFI_STA_ENTRY_CMD cmd,
+                                            const u8 *sta);
+
+static void vwifi_inactivity_sweep(struct work_struct *w);
+static DECLARE_DELAYED_WORK(vwifi_inactivity_dwork, vwifi_inactivity_sweep);
+
+/* Disassociate the local STAs of @ap idle for @timeout jiffies. The STAs leave
+ * the BSS through their own disconnect routine.
+ */
+static void vwifi_inactivity_reap(struct vwifi_vif *ap, unsigned long timeout)
+{
+    struct vwifi_vif *sta;
+    unsigned long last;
+
+    mutex_lock(&ap->lock);
+    list_for_each_entry (sta, &ap->bss_list, bss_list) {
+        last = READ_ONCE(sta->tx_time);
+        if (time_before(last, sta->conn_time))
+            last = sta->conn_time;
+        if (time_before(jiffies, last + timeout) ||
+            work_pending(&sta->ws_disconnect))
+            continue;
+
+        pr_info("vwifi: %s disassociates %s after %u s of inactivity\n",
+                ap->ndev->name, sta->ndev->name, ap->inactivity_timeout);
+        sta->disconnect_reason_code = WLAN_REASON_DISASSOC_DUE_TO_INACTIVITY;
+        schedule_work(&sta->ws_disconnect);
+    }
+    mutex_unlock(&ap->lock);
+}
+
+/* Same for the STAs reached through virtio, which are only known by the
+ * entries of bss_sta_table.
+ */
+static void vwifi_inactivity_reap_virtio(struct vwifi_vif *ap,
+                                         unsigned long timeout)
+{
+    struct bss_sta_entry *sta_ent;
+    struct hlist_node *tmp;
+    HLIST_HEAD(stale);
+    int bkt;
+
+    mutex_lock(&ap->bss_sta_table_lock);
+    hash_for_each_safe (ap->bss_sta_table, bkt, tmp, sta_ent, node) {
+        if (ether_addr_equal(sta_ent->mac, ap->ndev->dev_addr) ||
+            time_before(jiffies, READ_ONCE(sta_ent->active_time) + timeout))
+            continue;
+
+        hash_del(&sta_ent->node);
+        ap->bss_sta_table_entry_num--;
+        hlist_add_head(&sta_ent->node, &stale);
+    }
+    mutex_unlock(&ap->bss_sta_table_lock);
+
+    hlist_for_each_entry_safe (sta_ent, tmp, &stale, node) {
+        pr_info("vwifi: %s disassociates %pM after %u s of inactivity\n",
+                ap->ndev->name, sta_ent->mac, ap->inactivity_timeout);
+        vwifi_virtio_disconnect_tx(ap, sta_ent->mac,
+                                   WLAN_REASON_DISASSOC_DUE_TO_INACTIVITY);
+        cfg80211_del_sta(ap->ndev, sta_ent->mac, GFP_KERNEL);
+        vwifi_virtio_sta_entry_response(ap, VWIFI_STA_ENTRY_DEL, sta_ent->mac);
+        hlist_del(&sta_ent->node);
+        vwifi_sta_entry_free(sta_ent);
+    }
+}
+
+/* A single sweep, run every VWIFI_INACTIVITY_SWEEP_MS, enforces the inactivity
+ * timeouts of all APs rather than a timer per STA. It rearms itself while an
+ * AP has a timeout.
+ */
+static void vwifi_inactivity_sweep(struct work_struct *w)
+{
+    struct vwifi_vif *ap;
+    unsigned long flags;
+    bool virtio, armed = false;
+
+    spin_lock_irqsave(&vwifi_virtio_lock, flags);
+    virtio = vwifi_virtio_enabled;
+    spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        if (!ap->ap_enabled || !ap->inactivity_timeout)
+            continue;
+
+        armed = true;
+        if (virtio)
+            vwifi_inactivity_reap_virtio(ap, ap->inactivity_timeout * HZ);
+        else
+            vwifi_inactivity_reap(ap, ap->inactivity_timeout * HZ);
+    }
+    mutex_unlock(&vwifi->lock);
+
+    if (armed && vwifi->state != VWIFI_SHUTDOWN)
+        queue_delayed_work(
+            system_power_efficient_wq, &vwifi_inactivity_dwork,
+            round_jiffies_relative(
+                msecs_to_jiffies(VWIFI_INACTIVITY_SWEEP_MS)));
+}
+
 /* Called by the kernel when the user wants to create an Access Point.
  * Currently, it adds an SSID to the SSID table to emulate the AP signal and
  * records the SSID in the vwifi_context.
@@ -1457,9 +5084,8 @@ static int vwifi_start_ap(struct wiphy *wiphy,
                           struct cfg80211_ap_settings *settings)
 {
     struct vwifi_vif *vif = ndev_get_vwifi_vif(ndev);
+    struct vwifi_vif *tx = NULL;
     struct bss_sta_entry *sta_ent;
-    int ie_offset = DOT11_MGMT_HDR_LEN + DOT11_BCN_PRB_FIXED_LEN;
-    int head_ie_len, tail_ie_len;
     unsigned long flags;
     u32 key;
 
@@ -1475,6 +5101,15 @@ static int vwifi_start_ap(struct wiphy *wiphy,
     if (settings->ssid == NULL)
         return -EINVAL;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    /* Member of a multi-BSSID set, possibly its transmitting BSS */
+    if (settings->mbssid_config.tx_wdev) {
+        tx = wdev_get_vwifi_vif(settings->mbssid_config.tx_wdev);
+        if (tx != vif && !tx->ap_enabled)
+            return -EINVAL;
+    }
+#endif
+
     /* Setting up AP SSID and BSSID */
     vif->ssid_len = settings->ssid_len;
     memcpy(vif->ssid, settings->ssid, settings->ssid_len);
@@ -1483,36 +5118,34 @@ static int vwifi_start_ap(struct wiphy *wiphy,
     /* AP is the head of vif->bss_list */
     INIT_LIST_HEAD(&vif->bss_list);
 
-    /* Add AP to global ap_list */
+    vwifi_neigh_init(vif);
+    vif->proxy_arp = READ_ONCE(proxy_arp);
+    vwifi_mcast_init(vif);
+
+    /* Add AP to global ap_list, once ready for the walks of debugfs */
+    mutex_lock(&vwifi->lock);
     list_add_tail(&vif->ap_list, &vwifi->ap_list);
+    mutex_unlock(&vwifi->lock);
+
+    INIT_LIST_HEAD(&vif->lsta_list);
+    vif->n_lsta = 0;
+    vif->beacon_count = 0;
+    vif->lsta_bcast = 0;
+    vif->lsta_bcast_bytes = 0;
+    vif->lsta_cursor = NULL;
 
     vif->ap_enabled = true;
 
     vif->privacy = settings->privacy;
 
-    /* cfg80211 and some upper user-space programs treat IEs as two-part:
-     * 1. head: 802.11 beacon frame header + beacon IEs before TIM IE
-     * 2. tail: beacon IEs after TIM IE
-     * We combine them and store them in vif->beacon_ie.
-     */
-    head_ie_len = settings->beacon.head_len - ie_offset;
-    tail_ie_len = settings->beacon.tail_len;
-
-    if (likely(head_ie_len + tail_ie_len <= IE_MAX_LEN)) {
-        vif->beacon_ie_len = head_ie_len + tail_ie_len;
-        memset(vif->beacon_ie, 0, IE_MAX_LEN);
-        memcpy(vif->beacon_ie, &settings->beacon.head[ie_offset], head_ie_len);
-        memcpy(vif->beacon_ie + head_ie_len, settings->beacon.tail,
-               tail_ie_len);
-
-        pr_info(
-            "%s: privacy = %x, head_ie_len (before TIM IE) = %d, tail_ie_len = "
-            "%d",
-            __func__, settings->privacy, head_ie_len, tail_ie_len);
-    } else {
-        pr_info("%s: IE exceed %d bytes!\n", __func__, IE_MAX_LEN);
+    /* Enforced by vwifi_inactivity_sweep(), which has to be running */
+    vif->inactivity_timeout = settings->inactivity_timeout;
+    if (vif->inactivity_timeout)
+        queue_delayed_work(system_power_efficient_wq, &vwifi_inactivity_dwork,
+                           msecs_to_jiffies(VWIFI_INACTIVITY_SWEEP_MS));
+
+    if (vwifi_set_beacon_ies(vif, &settings->beacon))
         return 1;
-    }
 
     if (settings->chandef.chan) {
         pr_info("vwifi: %s center freq: %d\n", ndev->name,
@@ -1533,8 +5166,21 @@ static int vwifi_start_ap(struct wiphy *wiphy,
     pr_info("vwifi: init beacon_timer.\n");
     hrtimer_init(&vif->beacon_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
     vif->beacon_timer.function = vwifi_beacon;
+    vif->beacon_parked = false;
+
+    spin_lock_bh(&vif_list_lock);
+    vif->mbssid_tx = tx;
+    if (tx && tx != vif) {
+        /* Shares the channel, and the beacons, of the transmitting BSS */
+        vif->channel = tx->channel;
+        vif->bw = tx->bw;
+        vif->beacon_int = tx->beacon_int;
+        list_add_tail(&vif->mbssid, &tx->mbssid);
+    }
+    spin_unlock_bh(&vif_list_lock);
 
-    if (!hrtimer_is_queued(&vif->beacon_timer)) {
+    /* A non-transmitted BSS is carried by the beacons of its transmitter */
+    if ((!tx || tx == vif) && !hrtimer_is_queued(&vif->beacon_timer)) {
         u64 tsf, until_tbtt;
         tsf = ktime_to_us(ktime_get_real());
         u32 bcn_int = vif->beacon_int;
@@ -1549,13 +5195,14 @@ static int vwifi_start_ap(struct wiphy *wiphy,
     if (vwifi_virtio_enabled) {
         spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 
-        sta_ent = kmalloc(sizeof(struct bss_sta_entry), GFP_ATOMIC);
+        sta_ent = vwifi_sta_entry_alloc(GFP_ATOMIC);
         if (!sta_ent) {
             spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
             return 1;
         }
 
         memcpy(sta_ent->mac, vif->ndev->dev_addr, ETH_ALEN);
+        sta_ent->active_time = jiffies;
         key = vwifi_mac_to_32(sta_ent->mac);
         hash_add(vif->bss_sta_table, &sta_ent->node, key);
         vif->bss_sta_table_entry_num++;
@@ -1567,7 +5214,43 @@ static int vwifi_start_ap(struct wiphy *wiphy,
     return 0;
 }
 
-static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif);
+/* Disassociate all the STAs of @ap, which stops. The members leave the BSS
+ * in a single splice, then each SME learns about it from its disconnect work.
+ */
+static void vwifi_ap_disassociate_all(struct vwifi_vif *ap, u16 reason)
+{
+    struct vwifi_vif *sta, *safe;
+    LIST_HEAD(members);
+    unsigned int n = 0;
+
+    mutex_lock(&ap->lock);
+    ap->ap_enabled = false;
+    list_splice_init(&ap->bss_list, &members);
+    mutex_unlock(&ap->lock);
+
+    list_for_each_entry_safe (sta, safe, &members, bss_list) {
+        list_del_init(&sta->bss_list);
+        cfg80211_del_sta(ap->ndev, sta->ndev->dev_addr, GFP_KERNEL);
+
+        /* Unless the STA is leaving by itself already */
+        mutex_lock(&sta->lock);
+        if (sta->ap == ap) {
+            WRITE_ONCE(sta->ap, NULL);
+            sta->sme_state = SME_DISCONNECTED;
+            sta->disconnect_reason_code = reason;
+            queue_work(system_unbound_wq, &sta->ws_disconnect);
+            n++;
+        }
+        mutex_unlock(&sta->lock);
+    }
+
+    if (n)
+        pr_info("vwifi: %s disassociated %u STAs\n", ap->ndev->name, n);
+}
+
+static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif,
+                                       const u8 *dest,
+                                       u16 reason);
 
 /* Called by the kernel when there is a need to "stop" from AP mode. It uses
  * the SSID to remove the AP node from the SSID table.
@@ -1589,39 +5272,54 @@ static int vwifi_stop_ap(struct wiphy *wiphy, struct net_device *ndev)
 
     pr_info("vwifi: %s stop acting in AP mode.\n", ndev->name);
 
+    vwifi_mbssid_leave(vif);
+
+    /* Remove ap from global ap_list, so that no STA finds it anymore. It is
+     * added back by the next vwifi_start_ap(). Done first, so that
+     * vwifi_beacon_wake() cannot restart the timer once cancelled.
+     */
+    mutex_lock(&vwifi->lock);
+    list_del(&vif->ap_list);
+    vif->ap_enabled = false;
+    mutex_unlock(&vwifi->lock);
+
+    /* Interfaces added at runtime can be deleted while the module runs */
+    hrtimer_cancel(&vif->beacon_timer);
+
+    vwifi_lsta_flush(vif);
+
     spin_lock_irqsave(&vwifi_virtio_lock, flags);
     if (vwifi_virtio_enabled) {
         spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
-        vwifi_virtio_disconnect_tx(vif);
+        vwifi_virtio_disconnect_tx(vif, NULL, WLAN_REASON_DEAUTH_LEAVING);
 
-        hash_for_each_safe (vif->bss_sta_table, bkt, tmp, sta_ent, node)
-            kfree(sta_ent);
+        mutex_lock(&vif->bss_sta_table_lock);
+        hash_for_each_safe (vif->bss_sta_table, bkt, tmp, sta_ent, node) {
+            hash_del(&sta_ent->node);
+            vwifi_sta_entry_free(sta_ent);
+        }
         vif->bss_sta_table_entry_num = 0;
+        mutex_unlock(&vif->bss_sta_table_lock);
 
-        spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+        vif->ap_enabled = false;
         return 0;
     }
 
     spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 
     if (vwifi->state == VWIFI_SHUTDOWN) {
-        hrtimer_cancel(&vif->beacon_timer);
-
-        /* Destroy bss_list first */
+        /* The STAs may be gone already, only unlink them */
         list_for_each_entry_safe (pos, safe, &vif->bss_list, bss_list)
             list_del(&pos->bss_list);
-
-        /* Remove ap from global ap_list */
-        if (mutex_lock_interruptible(&vwifi->lock))
-            return -ERESTARTSYS;
-
-        list_del(&vif->ap_list);
-
-        mutex_unlock(&vwifi->lock);
+    } else {
+        vwifi_ap_disassociate_all(vif, WLAN_REASON_DEAUTH_LEAVING);
     }
 
     vif->ap_enabled = false;
 
+    vwifi_neigh_flush(vif);
+    vwifi_mcast_flush(vif);
+
     return 0;
 }
 
@@ -1635,39 +5333,13 @@ static int vwifi_change_beacon(struct wiphy *wiphy,
 )
 {
     struct vwifi_vif *vif = ndev_get_vwifi_vif(ndev);
-    int ie_offset = DOT11_MGMT_HDR_LEN + DOT11_BCN_PRB_FIXED_LEN;
-    int head_ie_len, tail_ie_len;
 
-    /* cfg80211 and some user-space programs treat IEs as two-part:
-     * 1. head: 802.11 beacon frame header + beacon IEs before TIM IE
-     * 2. tail: beacon IEs after TIM IE
-     * We combine them and store them in vif->beacon_ie.
-     */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
-    head_ie_len = info->beacon.head_len - ie_offset;
-    tail_ie_len = info->beacon.tail_len;
-#else
-    head_ie_len = info->head_len - ie_offset;
-    tail_ie_len = info->tail_len;
-#endif
-    if (likely(head_ie_len + tail_ie_len <= IE_MAX_LEN)) {
-        vif->beacon_ie_len = head_ie_len + tail_ie_len;
-        memset(vif->beacon_ie, 0, IE_MAX_LEN);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
-        memcpy(vif->beacon_ie, &info->beacon.head[ie_offset], head_ie_len);
-        memcpy(vif->beacon_ie + head_ie_len, info->beacon.tail, tail_ie_len);
+    if (vwifi_set_beacon_ies(vif, &info->beacon))
 #else
-        memcpy(vif->beacon_ie, &info->head[ie_offset], head_ie_len);
-        memcpy(vif->beacon_ie + head_ie_len, info->tail, tail_ie_len);
+    if (vwifi_set_beacon_ies(vif, info))
 #endif
-        pr_info(
-            "%s: head_ie_len (before TIM IE) = %d, tail_ie_len = "
-            "%d",
-            __func__, head_ie_len, tail_ie_len);
-    } else {
-        pr_info("%s: IE exceed %d bytes!\n", __func__, IE_MAX_LEN);
         return 1;
-    }
 
     return 0;
 }
@@ -1763,11 +5435,12 @@ static int vwifi_change_station(struct wiphy *wiphy,
      * STAs know the existent of the STA.
      */
     if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
-        sta_entry = kmalloc(sizeof(struct bss_sta_entry), GFP_KERNEL);
+        sta_entry = vwifi_sta_entry_alloc(GFP_KERNEL);
         if (!sta_entry)
             return -ENOMEM;
 
         memcpy(sta_entry->mac, mac, ETH_ALEN);
+        sta_entry->active_time = jiffies;
 
         mutex_lock(&vif->bss_sta_table_lock);
 
@@ -1803,31 +5476,50 @@ static int vwifi_change_station(struct wiphy *wiphy,
     return 0;
 }
 
-/* Unregister and free a virtual interface identified by @vif->ndev. */
-static int vwifi_delete_interface(struct vwifi_vif *vif)
+/* Stop everything @vif runs and free its queues, before its net_device goes
+ * away.
+ */
+static int vwifi_vif_teardown(struct vwifi_vif *vif)
 {
     struct vwifi_packet *pkt = NULL, *safe = NULL;
-    struct wiphy *wiphy = vif->wdev.wiphy;
     struct bss_sta_entry *sta_ent;
+    struct vwifi_ie_cache_entry *ie_ent;
     struct hlist_node *tmp;
     int bkt;
 
+    vwifi_grid_del(vif);
+
+    /* An AP still running when its interface goes away */
+    if (vif->wdev.iftype == NL80211_IFTYPE_AP && vif->ap_enabled)
+        hrtimer_cancel(&vif->beacon_timer);
+
     /* Stop TX queue, and delete the pending packets */
     netif_stop_queue(vif->ndev);
+    vwifi_edt_flush(vif);
+    cancel_work_sync(&vif->ws_rx);
     list_for_each_entry_safe (pkt, safe, &vif->rx_queue, list) {
         list_del(&pkt->list);
-        kfree(pkt);
+        vwifi_packet_free(pkt);
     }
+    vif->rx_queue_len = 0;
 
     hash_for_each_safe (vif->bss_sta_table, bkt, tmp, sta_ent, node)
-        kfree(sta_ent);
+        vwifi_sta_entry_free(sta_ent);
+    hash_for_each_safe (vif->ie_cache, bkt, tmp, ie_ent, node) {
+        vwifi_mem_sub(VWIFI_MEM_IE, struct_size(ie_ent, ies, ie_ent->ies_len));
+        kfree(ie_ent);
+    }
 
     if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
         if (mutex_lock_interruptible(&vif->lock))
             return -ERESTARTSYS;
 
         cancel_work_sync(&vif->ws_scan);
+        spin_lock_bh(&vwifi_scan_batch_lock);
+        list_del_init(&vif->scan_batch);
+        spin_unlock_bh(&vwifi_scan_batch_lock);
         cancel_work_sync(&vif->ws_scan_timeout);
+        vwifi_scan_snap_put(xchg(&vif->scan_snap, NULL));
         del_timer_sync(&vif->scan_complete);
 
         /* If there's a pending scan, call cfg80211_scan_done to finish it. */
@@ -1843,17 +5535,13 @@ static int vwifi_delete_interface(struct vwifi_vif *vif)
         cancel_work_sync(&vif->ws_connect);
         cancel_work_sync(&vif->ws_disconnect);
 
+        /* Still associated, the AP must not keep pointing to the STA */
+        vwifi_sta_leave_bss(vif);
+
         mutex_unlock(&vif->lock);
     }
 
-    /* Deallocate net_device */
-    unregister_netdev(vif->ndev);
-    free_netdev(vif->ndev);
-
-    /* Deallocate wiphy device */
-    wiphy_unregister(wiphy);
-    wiphy_free(wiphy);
-
+    vwifi_mem_sub(VWIFI_MEM_VIF, sizeof(struct vwifi_vif));
     return 0;
 }
 
@@ -1922,8 +5610,12 @@ static int vwifi_get_tx_power(struct wiphy *wiphy,
  * corresponding "disconnect" function.
  */
 static struct cfg80211_ops vwifi_cfg_ops = {
+    .add_virtual_intf = vwifi_add_virtual_intf,
+    .del_virtual_intf = vwifi_del_virtual_intf,
     .change_virtual_intf = vwifi_change_iface,
     .scan = vwifi_scan,
+    .sched_scan_start = vwifi_sched_scan_start,
+    .sched_scan_stop = vwifi_sched_scan_stop,
     .connect = vwifi_connect,
     .disconnect = vwifi_disconnect,
     .get_station = vwifi_get_station,
@@ -1996,21 +5688,93 @@ static struct ieee80211_supported_band nf_band_2ghz;
 /* Describes supported band of 5GHz. */
 static struct ieee80211_supported_band nf_band_5ghz;
 
-/* Unregister and free virtual interfaces and wiphy. */
-static void vwifi_free(void)
+/* A radio runs a single STA, or up to VWIFI_MBSSID_MAX BSSes of a multi-BSSID
+ * AP on one channel.
+ */
+static const struct ieee80211_iface_limit vwifi_iface_limits_sta[] = {
+    {.max = 1, .types = BIT(NL80211_IFTYPE_STATION)},
+};
+
+static const struct ieee80211_iface_limit vwifi_iface_limits_ap[] = {
+    {.max = VWIFI_MBSSID_MAX, .types = BIT(NL80211_IFTYPE_AP)},
+};
+
+static const struct ieee80211_iface_combination vwifi_iface_combinations[] = {
+    {
+        .limits = vwifi_iface_limits_sta,
+        .n_limits = ARRAY_SIZE(vwifi_iface_limits_sta),
+        .max_interfaces = 1,
+        .num_different_channels = 1,
+    },
+    {
+        .limits = vwifi_iface_limits_ap,
+        .n_limits = ARRAY_SIZE(vwifi_iface_limits_ap),
+        .max_interfaces = VWIFI_MBSSID_MAX,
+        .num_different_channels = 1,
+        .beacon_int_infra_match = true,
+    },
+};
+
+/* Unregister and free all virtual interfaces, and return how many there were.
+ * The net_devices go away in one batch under a single rtnl hold, rather than
+ * with an rtnl round trip and synchronize_net() each.
+ */
+static unsigned int vwifi_free(void)
 {
     struct vwifi_vif *vif = NULL, *safe = NULL;
+    LIST_HEAD(vifs);
+    LIST_HEAD(unreg);
+    unsigned int n = 0;
+    u64 start = ktime_get_ns();
 
     spin_lock_bh(&vif_list_lock);
-    list_for_each_entry_safe (vif, safe, &vwifi->vif_list, list) {
-        spin_unlock_bh(&vif_list_lock);
-        vwifi_delete_interface(vif);
-        spin_lock_bh(&vif_list_lock);
-    }
+    list_splice_init(&vwifi->vif_list, &vifs);
     spin_unlock_bh(&vif_list_lock);
 
+    /* Stop the queues, timers and work of every vif first */
+    list_for_each_entry (vif, &vifs, list)
+        vwifi_vif_teardown(vif);
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_TEARDOWN], &start);
+
+    rtnl_lock();
+    list_for_each_entry (vif, &vifs, list) {
+        unregister_netdevice_queue(vif->ndev, &unreg);
+        n++;
+    }
+    unregister_netdevice_many(&unreg);
+    rtnl_unlock();
+
+    /* Queued by cfg80211 disconnecting the STAs on unregistration. Their
+     * routines may still reach the AP, so none may run once the first
+     * net_device is freed.
+     */
+    list_for_each_entry (vif, &vifs, list) {
+        if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
+            cancel_work_sync(&vif->ws_connect);
+            cancel_work_sync(&vif->ws_disconnect);
+        }
+    }
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_NETDEV], &start);
+
+    /* In reverse, so interfaces added on the wiphy of another one go first */
+    list_for_each_entry_safe_reverse (vif, safe, &vifs, list) {
+        struct wiphy *wiphy = vif->wdev.wiphy;
+        bool secondary = vif->secondary;
+
+        free_netdev(vif->ndev);
+
+        /* Deallocate wiphy device, unless borrowed from another interface */
+        if (!secondary) {
+            wiphy_unregister(wiphy);
+            wiphy_free(wiphy);
+        }
+    }
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_WIPHY], &start);
+
     kfree(vwifi->denylist);
     kfree(vwifi);
+
+    return n;
 }
 
 /* Allocate and register wiphy.
@@ -2077,6 +5841,12 @@ static struct wiphy *vwifi_cfg80211_add(void)
      */
     wiphy->interface_modes =
         BIT(NL80211_IFTYPE_STATION) | BIT(NL80211_IFTYPE_AP);
+    wiphy->iface_combinations = vwifi_iface_combinations;
+    wiphy->n_iface_combinations = ARRAY_SIZE(vwifi_iface_combinations);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    /* Up to VWIFI_MBSSID_MAX BSSes beaconing through one transmitting BSS */
+    wiphy->mbssid_max_interfaces = VWIFI_MBSSID_MAX;
+#endif
 
     for (band = NL80211_BAND_2GHZ; band < NUM_NL80211_BANDS; band++) {
         /* FIXME: add other band capabilities if needed, such as 40 width */
@@ -2092,6 +5862,9 @@ static struct wiphy *vwifi_cfg80211_add(void)
                 kmemdup(vwifi_supported_rates, sizeof(vwifi_supported_rates),
                         GFP_KERNEL);
             nf_band_2ghz.n_bitrates = ARRAY_SIZE(vwifi_supported_rates);
+            vwifi_mem_add(VWIFI_MEM_BAND,
+                          sizeof(vwifi_supported_channels_2ghz) +
+                              sizeof(vwifi_supported_rates));
             wiphy->bands[band] = &nf_band_2ghz;
             break;
         case NL80211_BAND_5GHZ:
@@ -2105,6 +5878,10 @@ static struct wiphy *vwifi_cfg80211_add(void)
                             sizeof(struct ieee80211_rate),
                         GFP_KERNEL);
             nf_band_5ghz.n_bitrates = ARRAY_SIZE(vwifi_supported_rates) - 4;
+            vwifi_mem_add(VWIFI_MEM_BAND,
+                          sizeof(vwifi_supported_channels_5ghz) +
+                              nf_band_5ghz.n_bitrates *
+                                  sizeof(struct ieee80211_rate));
             wiphy->bands[band] = &nf_band_5ghz;
             break;
         default:
@@ -2118,6 +5895,17 @@ static struct wiphy *vwifi_cfg80211_add(void)
     wiphy->max_scan_ssids = MAX_PROBED_SSIDS;
     wiphy->max_scan_ie_len = IE_MAX_LEN;
 
+    /* scheduled scan - background scans are run by the driver, which only
+     * reports to userspace when the matching BSSes change.
+     */
+    wiphy->max_sched_scan_reqs = 1;
+    wiphy->max_sched_scan_ssids = MAX_PROBED_SSIDS;
+    wiphy->max_match_sets = MAX_PROBED_SSIDS;
+    wiphy->max_sched_scan_ie_len = IE_MAX_LEN;
+    wiphy->max_sched_scan_plans = VWIFI_SCHED_SCAN_MAX_PLANS;
+    wiphy->max_sched_scan_plan_interval = U16_MAX;
+    wiphy->max_sched_scan_plan_iterations = U16_MAX;
+
     /* Signal type
      * CFG80211_SIGNAL_TYPE_UNSPEC allows us specify signal strength from 0 to
      * 100. The reasonable value for CFG80211_SIGNAL_TYPE_MBM is -3000 to -10000
@@ -2127,6 +5915,9 @@ static struct wiphy *vwifi_cfg80211_add(void)
 
     wiphy->flags |= WIPHY_FLAG_NETNS_OK;
 
+    /* APs disassociate idle STAs by themselves, see vwifi_inactivity_sweep() */
+    wiphy->features |= NL80211_FEATURE_INACTIVITY_TIMER;
+
     wiphy->cipher_suites = vwifi_cipher_suites;
     wiphy->n_cipher_suites = ARRAY_SIZE(vwifi_cipher_suites);
 
@@ -2168,16 +5959,22 @@ static void vwifi_virtio_scan_request(struct vwifi_vif *vif)
     struct ethhdr *eth;
     struct vwifi_virtio_header *vvh;
     struct vwifi_virtio_scan_req *scan_req;
+    struct vwifi_ie_cache_entry *ent;
     int len = ETH_HLEN + VWIFI_VIRTIO_HEADER_TYPE_BYTE +
               sizeof(struct vwifi_virtio_scan_req);
     bool wildcard_ssid = false;
+    int bkt, n = 0;
 
     if (!vif->scan_request)
         return;
 
+    mutex_lock(&vif->lock);
+    len += vif->ie_cache_num * sizeof(struct vwifi_virtio_ie_gen);
     skb = dev_alloc_skb(len);
-    if (!skb)
+    if (!skb) {
+        mutex_unlock(&vif->lock);
         return;
+    }
 
     skb_put(skb, len);
 
@@ -2194,7 +5991,21 @@ static void vwifi_virtio_scan_request(struct vwifi_vif *vif)
     scan_req = (struct vwifi_virtio_scan_req *) ((u8 *) vvh +
                                                  VWIFI_VIRTIO_HEADER_TYPE_BYTE);
 
-    if (!vif->scan_request->n_ssids || !vif->scan_request->ssids[0].ssid_len)
+    vif->ie_cache_seq++;
+    hash_for_each (vif->ie_cache, bkt, ent, node) {
+        memcpy(scan_req->known[n].bssid, ent->bssid, ETH_ALEN);
+        scan_req->known[n].gen = cpu_to_le32(ent->gen);
+        ent->seq = vif->ie_cache_seq;
+        n++;
+    }
+    scan_req->n_known = cpu_to_le16(n);
+    mutex_unlock(&vif->lock);
+
+    /* A single SSID fits in the request. Scans for several SSIDs ask for all
+     * of them and filter the responses.
+     */
+    if (vif->scan_request->n_ssids != 1 ||
+        !vif->scan_request->ssids[0].ssid_len)
         wildcard_ssid = true;
 
     if (wildcard_ssid)
@@ -2205,9 +6016,37 @@ static void vwifi_virtio_scan_request(struct vwifi_vif *vif)
                vif->scan_request->ssids[0].ssid_len);
     }
 
+    vif->scan_wildcard = wildcard_ssid;
+    vif->scan_resps = 0;
+    vif->scan_deadline = jiffies + msecs_to_jiffies(virtio_scan_max_ms);
+
     vwifi_virtio_tx(vif, skb);
 
-    mod_timer(&vif->scan_timeout, jiffies + msecs_to_jiffies(2000));
+    /* Pushed forward, or fired early, as the responses arrive */
+    mod_timer(&vif->scan_timeout, vif->scan_deadline);
+}
+
+/* Account a response to the pending virtio scan of @vif. The scan completes
+ * once all the APs that answered the last wildcard scan answered, or once no
+ * response arrived for VWIFI_VIRTIO_SCAN_QUIET_MS, and at the latest
+ * virtio_scan_max_ms after the request. Called with vif->lock held.
+ */
+static void vwifi_virtio_scan_progress(struct vwifi_vif *vif)
+{
+    unsigned long expires;
+
+    vif->scan_resps++;
+
+    if (vif->scan_wildcard && vif->scan_known_aps &&
+        vif->scan_resps >= vif->scan_known_aps) {
+        expires = jiffies;
+    } else {
+        expires = jiffies + msecs_to_jiffies(VWIFI_VIRTIO_SCAN_QUIET_MS);
+        if (time_after(expires, vif->scan_deadline))
+            expires = vif->scan_deadline;
+    }
+
+    mod_timer(&vif->scan_timeout, expires);
 }
 
 static void vwifi_virtio_connect_request(struct vwifi_vif *vif)
@@ -2244,11 +6083,13 @@ static void vwifi_virtio_connect_request(struct vwifi_vif *vif)
     vwifi_virtio_tx(vif, skb);
 }
 
-static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif);
+static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif,
+                                       const u8 *dest,
+                                       u16 reason);
 
 static void vwifi_virtio_disconnect(struct vwifi_vif *vif)
 {
-    vwifi_virtio_disconnect_tx(vif);
+    vwifi_virtio_disconnect_tx(vif, vif->bssid, vif->disconnect_reason_code);
 
     cfg80211_disconnected(vif->ndev, vif->disconnect_reason_code, NULL, 0, true,
                           GFP_KERNEL);
@@ -2263,7 +6104,10 @@ static void vwifi_virtio_disconnect(struct vwifi_vif *vif)
     mutex_unlock(&vif->lock);
 }
 
-static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif)
+/* Send a disconnect frame to @dest, or to every STA of an AP if NULL */
+static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif,
+                                       const u8 *dest,
+                                       u16 reason)
 {
     struct sk_buff *skb;
     struct ethhdr *eth;
@@ -2281,13 +6125,15 @@ static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif)
     eth = (struct ethhdr *) skb->data;
     memcpy(eth->h_source, vif->ndev->dev_addr, ETH_ALEN);
 
-    if (vif->wdev.iftype == NL80211_IFTYPE_STATION)
-        memcpy(eth->h_dest, vif->bssid, ETH_ALEN);
-    /* right now AP only sent disconnect frame when cfg80211->stop_ap() */
-    else if (vif->wdev.iftype == NL80211_IFTYPE_AP)
+    if (dest) {
+        memcpy(eth->h_dest, dest, ETH_ALEN);
+    } else if (vif->wdev.iftype == NL80211_IFTYPE_AP) {
+        /* an AP broadcasts its disconnect frame when cfg80211->stop_ap() */
         eth_broadcast_addr(eth->h_dest);
-    else
+    } else {
+        dev_kfree_skb(skb);
         return;
+    }
 
     /* We treat our management frame as 802.3 type, so we put length here */
     eth->h_proto = htons(len);
@@ -2298,7 +6144,7 @@ static void vwifi_virtio_disconnect_tx(struct vwifi_vif *vif)
     disconn = (struct vwifi_virtio_disconn *) ((u8 *) vvh +
                                                VWIFI_VIRTIO_HEADER_TYPE_BYTE);
     memcpy(disconn->bssid, vif->bssid, ETH_ALEN);
-    disconn->reason_code = cpu_to_le16(vif->disconnect_reason_code);
+    disconn->reason_code = cpu_to_le16(reason);
 
     vwifi_virtio_tx(vif, skb);
 }
@@ -2449,11 +6295,12 @@ static void vwifi_virtio_mgmt_rx_sta_entry_response(
         }
 
         if (cmd == VWIFI_STA_ENTRY_ADD || cmd == VWIFI_STA_ENTRY_ADD_ALL) {
-            sta_ent = kmalloc(sizeof(struct bss_sta_entry), GFP_KERNEL);
+            sta_ent = vwifi_sta_entry_alloc(GFP_KERNEL);
             if (!sta_ent)
                 goto out_unlock;
 
             memcpy(sta_ent->mac, mac_p, ETH_ALEN);
+            sta_ent->active_time = jiffies;
             key = vwifi_mac_to_32(sta_ent->mac);
             hash_add(vif->bss_sta_table, &sta_ent->node, key);
             vif->bss_sta_table_entry_num++;
@@ -2462,7 +6309,7 @@ static void vwifi_virtio_mgmt_rx_sta_entry_response(
             hash_for_each_possible (vif->bss_sta_table, sta_ent, node, key) {
                 if (ether_addr_equal(sta_ent->mac, mac_p)) {
                     hlist_del_init(&sta_ent->node);
-                    kfree(sta_ent);
+                    vwifi_sta_entry_free(sta_ent);
                     vif->bss_sta_table_entry_num--;
                     break;
                 }
@@ -2500,8 +6347,8 @@ static void vwifi_virtio_mgmt_rx_disconnect(
     u32 key;
 
     if (vif->wdev.iftype == NL80211_IFTYPE_STATION) {
-        cfg80211_disconnected(vif->ndev, vif->disconnect_reason_code, NULL, 0,
-                              true, GFP_KERNEL);
+        cfg80211_disconnected(vif->ndev, le16_to_cpu(disconn->reason_code),
+                              NULL, 0, false, GFP_KERNEL);
 
         if (mutex_lock_interruptible(&vif->lock))
             return;
@@ -2520,7 +6367,7 @@ static void vwifi_virtio_mgmt_rx_disconnect(
         hash_for_each_possible (vif->bss_sta_table, tmp, node, key) {
             if (ether_addr_equal(tmp->mac, src)) {
                 hlist_del_init(&tmp->node);
-                kfree(tmp);
+                vwifi_sta_entry_free(tmp);
                 break;
             }
         }
@@ -2619,11 +6466,12 @@ static void vwifi_virtio_mgmt_rx_connect_request(
     vwifi_virtio_tx(vif, skb);
 
     if (!vif->privacy) {
-        sta_ent = kmalloc(sizeof(struct bss_sta_entry), GFP_KERNEL);
+        sta_ent = vwifi_sta_entry_alloc(GFP_KERNEL);
         if (!sta_ent)
             goto out_free_sinfo;
 
         memcpy(sta_ent->mac, src, ETH_ALEN);
+        sta_ent->active_time = jiffies;
 
         mutex_lock(&vif->bss_sta_table_lock);
 
@@ -2654,16 +6502,73 @@ out_free_sinfo:
     kfree(sinfo);
 }
 
+/* Called with vif->lock held */
+static struct vwifi_ie_cache_entry *vwifi_ie_cache_find(struct vwifi_vif *vif,
+                                                        const u8 *bssid)
+{
+    struct vwifi_ie_cache_entry *ent;
+
+    hash_for_each_possible (vif->ie_cache, ent, node, vwifi_mac_to_32(bssid))
+        if (ether_addr_equal(ent->bssid, bssid))
+            return ent;
+
+    return NULL;
+}
+
+/* Keep the IEs of generation @gen of @bssid, in place of the older ones, and
+ * of the BSS seen the longest time ago if the cache is full. The entries
+ * listed by the pending scan request stay, their APs answer without the IEs,
+ * so @bssid is not cached if only those are left. Called with vif->lock held.
+ */
+static void vwifi_ie_cache_store(struct vwifi_vif *vif,
+                                 const u8 *bssid,
+                                 u32 gen,
+                                 const u8 *ies,
+                                 u32 ies_len)
+{
+    struct vwifi_ie_cache_entry *ent, *it;
+    int bkt;
+
+    ent = vwifi_ie_cache_find(vif, bssid);
+    if (!ent && vif->ie_cache_num >= VWIFI_IE_CACHE_MAX) {
+        hash_for_each (vif->ie_cache, bkt, it, node) {
+            if (it->seq == vif->ie_cache_seq)
+                continue;
+            if (!ent || time_before(it->last_seen, ent->last_seen))
+                ent = it;
+        }
+        if (!ent)
+            return;
+    }
+    if (ent) {
+        hash_del(&ent->node);
+        vif->ie_cache_num--;
+        vwifi_mem_sub(VWIFI_MEM_IE, struct_size(ent, ies, ent->ies_len));
+        kfree(ent);
+    }
+
+    ent = kmalloc(struct_size(ent, ies, ies_len), GFP_KERNEL);
+    if (!ent)
+        return;
+    vwifi_mem_add(VWIFI_MEM_IE, struct_size(ent, ies, ies_len));
+
+    memcpy(ent->bssid, bssid, ETH_ALEN);
+    ent->gen = gen;
+    ent->last_seen = jiffies;
+    ent->seq = 0;
+    ent->ies_len = ies_len;
+    memcpy(ent->ies, ies, ies_len);
+
+    hash_add(vif->ie_cache, &ent->node, vwifi_mac_to_32(bssid));
+    vif->ie_cache_num++;
+}
+
 static void vwifi_virtio_mgmt_rx_scan_response(
     struct vwifi_vif *vif,
     const u8 *src,
     struct vwifi_virtio_scan_resp *scan_resp)
 {
     struct cfg80211_bss *bss;
-
-    if (vif->wdev.iftype != NL80211_IFTYPE_STATION)
-        return;
-
     struct ieee80211_channel rx_channel = {
         .band = NL80211_BAND_2GHZ,
         .center_freq = le32_to_cpu(scan_resp->channel),
@@ -2675,14 +6580,53 @@ static void vwifi_virtio_mgmt_rx_scan_response(
 #endif
         .signal = DBM_TO_MBM(rand_int_smooth(-100, -30, jiffies)),
     };
+    struct vwifi_ie_cache_entry *ent;
+    u32 gen = le32_to_cpu(scan_resp->beacon_ie_gen);
+    const u8 *ies = scan_resp->beacon_ies;
+    u32 ies_len = le32_to_cpu(scan_resp->beacon_ies_len);
+
+    if (vif->wdev.iftype != NL80211_IFTYPE_STATION)
+        return;
+
+    if (mutex_lock_interruptible(&vif->lock))
+        return;
+
+    /* Drop responses to another STA's scan */
+    if (!vif->scan_request)
+        goto out;
+
+    /* Drop responses not matching our scan, they still count as answers */
+    if (!vwifi_scan_match(vif->scan_request, scan_resp->ssid,
+                          min_t(u32, le32_to_cpu(scan_resp->ssid_len),
+                                IEEE80211_MAX_SSID_LEN),
+                          le32_to_cpu(scan_resp->channel)))
+        goto progress;
+
+    if (scan_resp->beacon_ies_known) {
+        ent = vwifi_ie_cache_find(vif, scan_resp->bssid);
+        /* Evicted since the request, the next scan gets the IEs */
+        if (!ent || ent->gen != gen)
+            goto progress;
+        ent->last_seen = jiffies;
+        ies = ent->ies;
+        ies_len = ent->ies_len;
+    } else {
+        ies_len = min_t(u32, ies_len, IE_MAX_LEN);
+        vwifi_ie_cache_store(vif, scan_resp->bssid, gen, ies, ies_len);
+    }
 
     bss = cfg80211_inform_bss_data(
         vif->wdev.wiphy, &data, CFG80211_BSS_FTYPE_UNKNOWN, scan_resp->bssid,
         le64_to_cpu(scan_resp->timestamp), le16_to_cpu(scan_resp->capab_info),
-        100, scan_resp->beacon_ies, le32_to_cpu(scan_resp->beacon_ies_len),
-        GFP_KERNEL);
+        100, ies, ies_len, GFP_KERNEL);
 
     cfg80211_put_bss(vif->wdev.wiphy, bss);
+
+progress:
+    /* Only once the BSS is known to cfg80211, as this may complete the scan */
+    vwifi_virtio_scan_progress(vif);
+out:
+    mutex_unlock(&vif->lock);
 }
 
 static void vwifi_virtio_mgmt_rx_scan_request(
@@ -2695,7 +6639,10 @@ static void vwifi_virtio_mgmt_rx_scan_request(
     struct vwifi_virtio_header *vvh;
     struct vwifi_virtio_scan_resp *scan_resp;
     int len = ETH_HLEN + VWIFI_VIRTIO_HEADER_TYPE_BYTE +
-              sizeof(struct vwifi_virtio_scan_resp) + vif->beacon_ie_len;
+              sizeof(struct vwifi_virtio_scan_resp);
+    u16 n_known = min_t(u16, le16_to_cpu(scan_req->n_known),
+                        VWIFI_IE_CACHE_MAX);
+    bool known = false;
 
     if (vif->wdev.iftype != NL80211_IFTYPE_AP)
         return;
@@ -2705,6 +6652,17 @@ static void vwifi_virtio_mgmt_rx_scan_request(
          memcmp(scan_req->ssid, vif->ssid, vif->ssid_len)))
         return;
 
+    /* Don't resend the IEs the STA already holds */
+    for (int i = 0; i < n_known; i++) {
+        if (ether_addr_equal(scan_req->known[i].bssid, vif->bssid) &&
+            le32_to_cpu(scan_req->known[i].gen) == vif->beacon_ie_gen) {
+            known = true;
+            break;
+        }
+    }
+    if (!known)
+        len += vif->beacon_ie_len;
+
     skb = dev_alloc_skb(len);
     if (!skb)
         return;
@@ -2734,8 +6692,14 @@ static void vwifi_virtio_mgmt_rx_scan_request(
     memcpy(scan_resp->ssid, vif->ssid, vif->ssid_len);
     scan_resp->channel = cpu_to_le32(
         vif->wdev.wiphy->bands[NL80211_BAND_2GHZ]->channels[0].center_freq);
-    scan_resp->beacon_ies_len = cpu_to_le32(vif->beacon_ie_len);
-    memcpy(scan_resp->beacon_ies, vif->beacon_ie, vif->beacon_ie_len);
+    scan_resp->beacon_ie_gen = cpu_to_le32(vif->beacon_ie_gen);
+    scan_resp->beacon_ies_known = known;
+    if (known) {
+        scan_resp->beacon_ies_len = 0;
+    } else {
+        scan_resp->beacon_ies_len = cpu_to_le32(vif->beacon_ie_len);
+        memcpy(scan_resp->beacon_ies, vif->beacon_ie, vif->beacon_ie_len);
+    }
 
     vwifi_virtio_tx(vif, skb);
 }
@@ -2803,6 +6767,7 @@ static void vwifi_virtio_data_rx(struct vwifi_vif *vif, struct sk_buff *skb)
     hash_for_each_possible (vif->bss_sta_table, sta_ent, node,
                             vwifi_mac_to_32(eth->h_source)) {
         if (ether_addr_equal(sta_ent->mac, eth->h_source)) {
+            sta_ent->active_time = jiffies;
             same_bss = true;
             break;
         }
@@ -2836,7 +6801,42 @@ static void vwifi_virtio_rx_switch(struct vwifi_vif *vif, struct sk_buff *skb)
         vwifi_virtio_mgmt_rx(vif, skb);
 }
 
-static void vwifi_virtio_rx_work(struct work_struct *work)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+/* Use the hash the device reported in the header of @skb, so that RPS/RFS
+ * steer the flow without hashing it again.
+ */
+static void vwifi_virtio_rx_hash(struct sk_buff *skb)
+{
+    struct virtio_net_hdr_v1_hash *hdr =
+        (struct virtio_net_hdr_v1_hash *) skb->cb;
+    enum pkt_hash_types type;
+
+    switch (le16_to_cpu(hdr->hash_report)) {
+    case VIRTIO_NET_HASH_REPORT_TCPv4:
+    case VIRTIO_NET_HASH_REPORT_UDPv4:
+    case VIRTIO_NET_HASH_REPORT_TCPv6:
+    case VIRTIO_NET_HASH_REPORT_UDPv6:
+    case VIRTIO_NET_HASH_REPORT_TCPv6_EX:
+    case VIRTIO_NET_HASH_REPORT_UDPv6_EX:
+        type = PKT_HASH_TYPE_L4;
+        break;
+    case VIRTIO_NET_HASH_REPORT_IPv4:
+    case VIRTIO_NET_HASH_REPORT_IPv6:
+    case VIRTIO_NET_HASH_REPORT_IPv6_EX:
+        type = PKT_HASH_TYPE_L3;
+        break;
+    default:
+        return;
+    }
+
+    skb_set_hash(skb, le32_to_cpu(hdr->hash_value), type);
+}
+#endif
+
+/* Receive a frame from the RX vq @rxq, and give it a new buffer. Return
+ * false if there was none.
+ */
+static bool vwifi_virtio_rx_one(int rxq)
 {
     struct vwifi_vif *vif =
         list_first_entry(&vwifi->vif_list, struct vwifi_vif, list);
@@ -2848,22 +6848,42 @@ static void vwifi_virtio_rx_work(struct work_struct *work)
     if (!vwifi_virtio_enabled)
         goto out_unlock;
 
-    skb = virtqueue_get_buf(vwifi_vqs[VWIFI_VQ_RX], &len);
+    skb = virtqueue_get_buf(vwifi_vqs[rxq], &len);
     if (!skb)
         goto out_unlock;
     spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 
     skb_put(skb, len - vif->vnet_hdr_len);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    if (vwifi_virtio_hash)
+        vwifi_virtio_rx_hash(skb);
+#endif
+
     vwifi_virtio_rx_switch(vif, skb);
 
-    vwifi_virtio_fill_vq(vwifi_vqs[VWIFI_VQ_RX], vif->vnet_hdr_len);
+    vwifi_virtio_fill_vq(vwifi_vqs[rxq], vif->vnet_hdr_len);
 
-    schedule_work(&vwifi_virtio_rx);
-    return;
+    return true;
 
 out_unlock:
     spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+    return false;
+}
+
+static void vwifi_virtio_rx_work(struct work_struct *work)
+{
+    if (vwifi_virtio_rx_one(VWIFI_VQ_RX))
+        schedule_work(&vwifi_virtio_rx);
+}
+
+/* Management frames are received on a high priority worker, ahead of the
+ * data frames waiting for the regular one.
+ */
+static void vwifi_virtio_rx_mgmt_work(struct work_struct *work)
+{
+    if (vwifi_virtio_rx_one(VWIFI_VQ_MGMT_RX))
+        queue_work(system_highpri_wq, &vwifi_virtio_rx_mgmt);
 }
 
 static void vwifi_virtio_tx_done(struct virtqueue *vq)
@@ -2883,10 +6903,17 @@ static void vwifi_virtio_rx_done(struct virtqueue *vq)
     schedule_work(&vwifi_virtio_rx);
 }
 
+static void vwifi_virtio_rx_mgmt_done(struct virtqueue *vq)
+{
+    queue_work(system_highpri_wq, &vwifi_virtio_rx_mgmt);
+}
+
 static netdev_tx_t vwifi_virtio_tx(struct vwifi_vif *vif, struct sk_buff *skb)
 {
     struct virtio_net_hdr_mrg_rxbuf *hdr =
         (struct virtio_net_hdr_mrg_rxbuf *) skb->cb;
+    struct ethhdr *eth = (struct ethhdr *) skb->data;
+    struct virtqueue *txq;
     struct scatterlist sg[2];
     int err;
     unsigned long flags;
@@ -2897,6 +6924,11 @@ static netdev_tx_t vwifi_virtio_tx(struct vwifi_vif *vif, struct sk_buff *skb)
         goto out_free;
     }
 
+    /* Management frames don't queue up behind the data frames */
+    txq = vwifi_vqs[VWIFI_VQ_TX];
+    if (vwifi_vqs[VWIFI_VQ_MGMT_TX] && !eth_proto_is_802_3(eth->h_proto))
+        txq = vwifi_vqs[VWIFI_VQ_MGMT_TX];
+
     memset(hdr, 0, vif->vnet_hdr_len);
     hdr->hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
     hdr->hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
@@ -2905,11 +6937,11 @@ static netdev_tx_t vwifi_virtio_tx(struct vwifi_vif *vif, struct sk_buff *skb)
     sg_set_buf(sg, hdr, vif->vnet_hdr_len);
     sg_set_buf(sg + 1, skb->data, skb->len);
 
-    err = virtqueue_add_outbuf(vwifi_vqs[VWIFI_VQ_TX], sg, 2, skb, GFP_ATOMIC);
+    err = virtqueue_add_outbuf(txq, sg, 2, skb, GFP_ATOMIC);
 
     if (err)
         goto out_free;
-    if (!virtqueue_kick(vwifi_vqs[VWIFI_VQ_TX])) {
+    if (!virtqueue_kick(txq)) {
         pr_info("%s: virtqueue_kick fail\n", __func__);
         goto out_free;
     }
@@ -2923,19 +6955,302 @@ out_free:
     return err;
 }
 
+/* Send a command on the control vq, with @out (if any) as its data. Return
+ * true if the device acknowledged it.
+ */
+static bool vwifi_virtio_ctrl_cmd(u8 class, u8 cmd, struct scatterlist *out)
+{
+    struct virtqueue *vq = vwifi_vqs[VWIFI_VQ_CTRL];
+    struct scatterlist *sgs[3], hdr, stat;
+    unsigned int out_num = 0, len;
+    bool ok = false;
+
+    if (!vq)
+        return false;
+
+    mutex_lock(&vwifi_virtio_ctrl_lock);
+
+    vwifi_ctrl->status = ~0;
+    vwifi_ctrl->hdr.class = class;
+    vwifi_ctrl->hdr.cmd = cmd;
+
+    sg_init_one(&hdr, &vwifi_ctrl->hdr, sizeof(vwifi_ctrl->hdr));
+    sgs[out_num++] = &hdr;
+    if (out)
+        sgs[out_num++] = out;
+    sg_init_one(&stat, &vwifi_ctrl->status, sizeof(vwifi_ctrl->status));
+    sgs[out_num] = &stat;
+
+    if (virtqueue_add_sgs(vq, sgs, out_num, 1, vwifi_ctrl, GFP_KERNEL) < 0)
+        goto out;
+    if (!virtqueue_kick(vq))
+        goto out;
+
+    /* The device answers without interrupt, so wait for it here */
+    while (!virtqueue_get_buf(vq, &len) && !virtqueue_is_broken(vq))
+        cond_resched();
+
+    ok = vwifi_ctrl->status == VIRTIO_NET_OK;
+out:
+    mutex_unlock(&vwifi_virtio_ctrl_lock);
+    return ok;
+}
+
+static bool vwifi_virtio_ctrl_rx(u8 cmd, bool on)
+{
+    struct scatterlist sg;
+
+    vwifi_ctrl->onoff = on;
+    sg_init_one(&sg, &vwifi_ctrl->onoff, sizeof(vwifi_ctrl->onoff));
+
+    return vwifi_virtio_ctrl_cmd(VIRTIO_NET_CTRL_RX, cmd, &sg);
+}
+
+/* Program the RX filter of the host side, so that only the frames the vif
+ * wants cross into the guest: the ones sent to its address, to broadcast, and
+ * to the multicast groups it joined. The device only accepts its config MAC
+ * by itself, which the random address used without VIRTIO_NET_F_MAC isn't,
+ * so the address of the vif goes in the unicast table.
+ * Frames exchanged by the other VMs on the host bridge, e.g. flooded unicast
+ * of other BSSes, are then dropped by the host.
+ */
+static void vwifi_virtio_rx_mode_work(struct work_struct *work)
+{
+    struct vwifi_vif *vif =
+        list_first_entry(&vwifi->vif_list, struct vwifi_vif, list);
+    struct net_device *ndev = vif->ndev;
+    struct virtio_net_ctrl_mac *uc, *mc;
+    struct netdev_hw_addr *ha;
+    struct scatterlist sg[2];
+    bool promisc, allmulti;
+    int mc_count, i = 0;
+    void *buf;
+
+    if (!virtio_has_feature(vwifi_vdev, VIRTIO_NET_F_CTRL_RX))
+        return;
+
+    rtnl_lock();
+    promisc = ndev->flags & IFF_PROMISC;
+    allmulti = ndev->flags & IFF_ALLMULTI;
+    rtnl_unlock();
+
+    if (!vwifi_virtio_ctrl_rx(VIRTIO_NET_CTRL_RX_PROMISC, promisc))
+        pr_info("vwifi: failed to %s promiscuous mode\n",
+                promisc ? "enable" : "disable");
+    if (!vwifi_virtio_ctrl_rx(VIRTIO_NET_CTRL_RX_ALLMULTI, allmulti))
+        pr_info("vwifi: failed to %s all-multicast mode\n",
+                allmulti ? "enable" : "disable");
+
+    netif_addr_lock_bh(ndev);
+    mc_count = netdev_mc_count(ndev);
+    /* The unicast table, holding the vif address, then the multicast one */
+    buf = kzalloc(2 * sizeof(*uc) + (1 + mc_count) * ETH_ALEN, GFP_ATOMIC);
+    if (!buf) {
+        netif_addr_unlock_bh(ndev);
+        return;
+    }
+    uc = buf;
+    uc->entries = cpu_to_virtio32(vwifi_vdev, 1);
+    memcpy(uc->macs[0], ndev->dev_addr, ETH_ALEN);
+    mc = buf + sizeof(*uc) + ETH_ALEN;
+    mc->entries = cpu_to_virtio32(vwifi_vdev, mc_count);
+    netdev_for_each_mc_addr (ha, ndev)
+        memcpy(mc->macs[i++], ha->addr, ETH_ALEN);
+    netif_addr_unlock_bh(ndev);
+
+    sg_init_table(sg, 2);
+    sg_set_buf(&sg[0], uc, sizeof(*uc) + ETH_ALEN);
+    sg_set_buf(&sg[1], mc, sizeof(*mc) + mc_count * ETH_ALEN);
+
+    if (!vwifi_virtio_ctrl_cmd(VIRTIO_NET_CTRL_MAC,
+                               VIRTIO_NET_CTRL_MAC_TABLE_SET, sg))
+        pr_info("vwifi: failed to set the MAC filter (%d multicast)\n",
+                mc_count);
+
+    kfree(buf);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+/* The hash types we use among the ones the device supports, and the length of
+ * the Toeplitz key to give it.
+ */
+static u32 vwifi_virtio_hash_types(struct virtio_device *vdev, u8 *key_len)
+{
+    u32 types;
+
+    virtio_cread_le(vdev, struct virtio_net_config, supported_hash_types,
+                    &types);
+    virtio_cread_le(vdev, struct virtio_net_config, rss_max_key_size, key_len);
+    *key_len = min_t(u8, *key_len, NETDEV_RSS_KEY_LEN);
+
+    return types &
+           (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |
+            VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | VIRTIO_NET_RSS_HASH_TYPE_IPv6 |
+            VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDPv6);
+}
+
+/* Have the device hash the IP and TCP/UDP headers of received frames with a
+ * Toeplitz key, and report the hash. Data frames all use the first queue
+ * pair, so there is no indirection table to program: the spreading over the
+ * CPUs is left to RPS/RFS, which then follow each flow to the CPU of its
+ * socket.
+ */
+static void vwifi_virtio_hash_config(struct virtio_device *vdev)
+{
+    struct virtio_net_hash_config *cfg;
+    struct scatterlist sg;
+    u32 types;
+    u8 key_len;
+    int len;
+
+    types = vwifi_virtio_hash_types(vdev, &key_len);
+
+    len = offsetof(struct virtio_net_hash_config, hash_key_data) + key_len;
+    cfg = kzalloc(len, GFP_KERNEL);
+    if (!cfg)
+        return;
+
+    cfg->hash_types = cpu_to_le32(types);
+    cfg->hash_key_length = key_len;
+    netdev_rss_key_fill(cfg->hash_key_data, key_len);
+
+    sg_init_one(&sg, cfg, len);
+    if (!vwifi_virtio_ctrl_cmd(VIRTIO_NET_CTRL_MQ,
+                               VIRTIO_NET_CTRL_MQ_HASH_CONFIG, &sg))
+        pr_info("vwifi: failed to configure the RX hash\n");
+
+    kfree(cfg);
+}
+
+/* Enable the two queue pairs with RSS: the IP frames, i.e. data, all go to
+ * the first one, and the frames RSS does not classify, among which the vwifi
+ * management frames, to the second one. This also configures the hash report.
+ */
+static bool vwifi_virtio_rss_config(struct virtio_device *vdev)
+{
+    struct virtio_net_rss_config *cfg;
+    struct scatterlist sg;
+    u32 types;
+    u8 key_len;
+    bool ok;
+    int len;
+
+    types = vwifi_virtio_hash_types(vdev, &key_len);
+
+    len = offsetof(struct virtio_net_rss_config, hash_key_data) + key_len;
+    cfg = kzalloc(len, GFP_KERNEL);
+    if (!cfg)
+        return false;
+
+    cfg->hash_types = cpu_to_le32(types);
+    cfg->indirection_table_mask = 0;
+    cfg->indirection_table[0] = 0;
+    cfg->unclassified_queue = cpu_to_le16(1);
+    cfg->max_tx_vq = cpu_to_le16(2);
+    cfg->hash_key_length = key_len;
+    netdev_rss_key_fill(cfg->hash_key_data, key_len);
+
+    sg_init_one(&sg, cfg, len);
+    ok = vwifi_virtio_ctrl_cmd(VIRTIO_NET_CTRL_MQ,
+                               VIRTIO_NET_CTRL_MQ_RSS_CONFIG, &sg);
+    kfree(cfg);
+
+    return ok;
+}
+#endif
+
+/* Enable the queue pairs we use, before any frame is sent. Without RSS, the
+ * host spreads received frames over both pairs by itself, and the management
+ * frames only get their own TX vq. If the second pair can't be enabled, the
+ * management frames are sent along with the data frames.
+ */
+static void vwifi_virtio_set_queues(struct virtio_device *vdev)
+{
+    struct scatterlist sg;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    if (virtio_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        if (!vwifi_virtio_rss_config(vdev)) {
+            pr_info("vwifi: failed to configure RSS\n");
+            vwifi_vqs[VWIFI_VQ_MGMT_TX] = NULL;
+        }
+        return;
+    }
+#endif
+
+    if (vwifi_vqs[VWIFI_VQ_MGMT_RX]) {
+        vwifi_ctrl->mq.virtqueue_pairs = cpu_to_virtio16(vdev, 2);
+        sg_init_one(&sg, &vwifi_ctrl->mq, sizeof(vwifi_ctrl->mq));
+        if (!vwifi_virtio_ctrl_cmd(VIRTIO_NET_CTRL_MQ,
+                                   VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &sg)) {
+            pr_info("vwifi: failed to enable the management queue pair\n");
+            vwifi_vqs[VWIFI_VQ_MGMT_TX] = NULL;
+        }
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    if (vwifi_virtio_hash)
+        vwifi_virtio_hash_config(vdev);
+#endif
+}
+
 static int vwifi_virtio_init_vqs(struct virtio_device *vdev)
 {
-    vq_callback_t *callbacks[VWIFI_NUM_VQS] = {
-        [VWIFI_VQ_RX] = vwifi_virtio_rx_done,
-        [VWIFI_VQ_TX] = vwifi_virtio_tx_done,
-    };
-    const char *names[VWIFI_NUM_VQS] = {
-        [VWIFI_VQ_RX] = "rx",
-        [VWIFI_VQ_TX] = "tx",
-    };
+    bool ctrl = virtio_has_feature(vdev, VIRTIO_NET_F_CTRL_VQ);
+    struct virtqueue **vqs;
+    vq_callback_t **callbacks;
+    const char **names;
+    unsigned int nvqs;
+    u16 max_pairs;
+    int err = -ENOMEM;
+
+    /* The RX/TX vqs of every queue pair come first, then the control vq (if
+     * negotiated). The vqs without name are not set up.
+     */
+    if (virtio_cread_feature(vdev, VIRTIO_NET_F_MQ, struct virtio_net_config,
+                             max_virtqueue_pairs, &max_pairs) ||
+        max_pairs < 1)
+        max_pairs = 1;
+    nvqs = max_pairs * 2 + ctrl;
+
+    vqs = kcalloc(nvqs, sizeof(*vqs), GFP_KERNEL);
+    callbacks = kcalloc(nvqs, sizeof(*callbacks), GFP_KERNEL);
+    names = kcalloc(nvqs, sizeof(*names), GFP_KERNEL);
+    if (!vqs || !callbacks || !names)
+        goto out;
+
+    callbacks[0] = vwifi_virtio_rx_done;
+    names[0] = "rx";
+    callbacks[1] = vwifi_virtio_tx_done;
+    names[1] = "tx";
+    if (max_pairs > 1) {
+        callbacks[2] = vwifi_virtio_rx_mgmt_done;
+        names[2] = "mgmt-rx";
+        callbacks[3] = vwifi_virtio_tx_done;
+        names[3] = "mgmt-tx";
+    }
+    if (ctrl)
+        names[nvqs - 1] = "control";
 
-    return virtio_find_vqs(vdev, VWIFI_NUM_VQS, vwifi_vqs, callbacks, names,
-                           NULL);
+    err = virtio_find_vqs(vdev, nvqs, vqs, callbacks, names, NULL);
+    if (err)
+        goto out;
+
+    memset(vwifi_vqs, 0, sizeof(vwifi_vqs));
+    vwifi_vqs[VWIFI_VQ_RX] = vqs[0];
+    vwifi_vqs[VWIFI_VQ_TX] = vqs[1];
+    if (max_pairs > 1) {
+        vwifi_vqs[VWIFI_VQ_MGMT_RX] = vqs[2];
+        vwifi_vqs[VWIFI_VQ_MGMT_TX] = vqs[3];
+    }
+    if (ctrl)
+        vwifi_vqs[VWIFI_VQ_CTRL] = vqs[nvqs - 1];
+
+out:
+    kfree(names);
+    kfree(callbacks);
+    kfree(vqs);
+    return err;
 }
 
 static void vwifi_virtio_fill_vq(struct virtqueue *vq, u8 vnet_hdr_len)
@@ -2953,7 +7268,7 @@ static void vwifi_virtio_fill_vq(struct virtqueue *vq, u8 vnet_hdr_len)
     skb_reserve(skb, NET_IP_ALIGN);
 
     spin_lock_irqsave(&vwifi_virtio_lock, flags);
-    if (!vwifi_virtio_enabled)
+    if (!vwifi_virtio_enabled || !vq)
         goto out_free;
 
     sg_init_table(sg, 2);
@@ -2985,10 +7300,14 @@ static void vwifi_virtio_remove_vqs(struct virtio_device *vdev)
     vdev->config->reset(vdev);
 #endif
 
-    for (i = 0; i < ARRAY_SIZE(vwifi_vqs); i++) {
+    /* Commands on the control vq are completed before returning */
+    for (i = 0; i < VWIFI_VQ_CTRL; i++) {
         struct virtqueue *vq = vwifi_vqs[i];
         struct sk_buff *skb;
 
+        if (!vq)
+            continue;
+
         while ((skb = virtqueue_detach_unused_buf(vq)))
             dev_kfree_skb(skb);
     }
@@ -3020,14 +7339,27 @@ static int vwifi_virtio_probe(struct virtio_device *vdev)
         return -ENOENT;
 
     /* We assum VIRTIO_NET_F_MRG_RXBUF feature is off on the device */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    vwifi_virtio_hash = virtio_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT);
+    if (vwifi_virtio_hash)
+        vif->vnet_hdr_len = sizeof(struct virtio_net_hdr_v1_hash);
+    else
+#endif
     if (virtio_has_feature(vdev, VIRTIO_F_VERSION_1))
         vif->vnet_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
     else
         vif->vnet_hdr_len = sizeof(struct virtio_net_hdr);
 
+    vwifi_ctrl = kzalloc(sizeof(*vwifi_ctrl), GFP_KERNEL);
+    if (!vwifi_ctrl)
+        return -ENOMEM;
+
     err = vwifi_virtio_init_vqs(vdev);
-    if (err)
+    if (err) {
+        kfree(vwifi_ctrl);
         return err;
+    }
+    vwifi_vdev = vdev;
 
     /* Configuration may specify what MAC to use.  Otherwise random. */
     if (virtio_has_feature(vdev, VIRTIO_NET_F_MAC)) {
@@ -3045,10 +7377,15 @@ static int vwifi_virtio_probe(struct virtio_device *vdev)
 
     virtio_device_ready(vdev);
 
+    vwifi_virtio_set_queues(vdev);
+
     spin_lock_irqsave(&vwifi_virtio_lock, flags);
     vwifi_virtio_enabled = true;
     spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
 
+    /* Leave the promiscuous mode the device starts in */
+    schedule_work(&vwifi_virtio_rx_mode);
+
     return 0;
 }
 
@@ -3057,8 +7394,13 @@ static void vwifi_virtio_remove(struct virtio_device *vdev)
     vwifi_virtio_enabled = false;
 
     cancel_work_sync(&vwifi_virtio_rx);
+    cancel_work_sync(&vwifi_virtio_rx_mgmt);
+    cancel_work_sync(&vwifi_virtio_rx_mode);
 
     vwifi_virtio_remove_vqs(vdev);
+    vwifi_vdev = NULL;
+    kfree(vwifi_ctrl);
+    vwifi_ctrl = NULL;
 }
 
 
@@ -3071,6 +7413,13 @@ MODULE_DEVICE_TABLE(virtio, id_table);
 
 static unsigned int features[] = {
     VIRTIO_NET_F_MAC,
+    VIRTIO_NET_F_CTRL_VQ,
+    VIRTIO_NET_F_CTRL_RX,
+    VIRTIO_NET_F_MQ,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    VIRTIO_NET_F_HASH_REPORT,
+    VIRTIO_NET_F_RSS,
+#endif
 };
 
 static struct virtio_driver virtio_vwifi = {
@@ -3083,8 +7432,355 @@ static struct virtio_driver virtio_vwifi = {
     .remove = vwifi_virtio_remove,
 };
 
+/* Per-AP proxy ARP/ND setting and counters */
+static int vwifi_proxy_neigh_show(struct seq_file *m, void *v)
+{
+    struct vwifi_vif *ap;
+
+    seq_printf(m, "%-16s %5s %8s %14s %11s %13s %10s\n", "ap", "proxy",
+               "bindings", "arp_suppressed", "arp_flooded", "nd_suppressed",
+               "nd_flooded");
+
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        spin_lock_bh(&ap->neigh_lock);
+        seq_printf(m, "%-16s %5s %8u %14llu %11llu %13llu %10llu\n",
+                   ap->ndev->name, ap->proxy_arp ? "on" : "off",
+                   ap->neigh_num, ap->proxy_arp_suppressed,
+                   ap->proxy_arp_flooded, ap->proxy_nd_suppressed,
+                   ap->proxy_nd_flooded);
+        spin_unlock_bh(&ap->neigh_lock);
+    }
+    mutex_unlock(&vwifi->lock);
+
+    return 0;
+}
+
+static int vwifi_proxy_neigh_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vwifi_proxy_neigh_show, inode->i_private);
+}
+
+/* Writing "<ap> on|off" switches proxy ARP/ND of a started AP */
+static ssize_t vwifi_proxy_neigh_write(struct file *file,
+                                       const char __user *ubuf,
+                                       size_t count,
+                                       loff_t *ppos)
+{
+    char buf[64], name[IFNAMSIZ], onoff[8];
+    struct vwifi_vif *ap;
+    ssize_t ret = -ENODEV;
+    bool on;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if (sscanf(buf, "%15s %7s", name, onoff) != 2 || kstrtobool(onoff, &on))
+        return -EINVAL;
+
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        if (strcmp(ap->ndev->name, name))
+            continue;
+
+        WRITE_ONCE(ap->proxy_arp, on);
+        ret = count;
+        break;
+    }
+    mutex_unlock(&vwifi->lock);
+
+    return ret;
+}
+
+static const struct file_operations vwifi_proxy_neigh_fops = {
+    .owner = THIS_MODULE,
+    .open = vwifi_proxy_neigh_open,
+    .read = seq_read,
+    .write = vwifi_proxy_neigh_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Multicast groups snooped by each AP */
+static int vwifi_mcast_groups_show(struct seq_file *m, void *v)
+{
+    struct vwifi_mcast_group *grp;
+    struct vwifi_vif *ap;
+    int bkt;
+
+    seq_printf(m, "%-16s %-40s %8s\n", "ap", "group", "members");
+
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        spin_lock_bh(&ap->mcast_lock);
+        hash_for_each (ap->mcast_table, bkt, grp, node) {
+            if (ipv6_addr_v4mapped(&grp->addr))
+                seq_printf(m, "%-16s %-40pI4 %8u\n", ap->ndev->name,
+                           &grp->addr.s6_addr32[3], grp->nr_members);
+            else
+                seq_printf(m, "%-16s %-40pI6c %8u\n", ap->ndev->name,
+                           &grp->addr, grp->nr_members);
+        }
+        spin_unlock_bh(&ap->mcast_lock);
+    }
+    mutex_unlock(&vwifi->lock);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vwifi_mcast_groups);
+
+/* Live objects allocated by vwifi, and their bytes, by type */
+static int vwifi_memory_show(struct seq_file *m, void *v)
+{
+    struct vwifi_mem_stat total = {0};
+    int cpu;
+
+    seq_printf(m, "%-16s %10s %12s\n", "type", "objects", "bytes");
+
+    for (int type = 0; type < VWIFI_MEM_TYPES; type++) {
+        struct vwifi_mem_stat sum = {0};
+
+        for_each_possible_cpu (cpu) {
+            sum.objs += per_cpu(vwifi_mem_stats[type].objs, cpu);
+            sum.bytes += per_cpu(vwifi_mem_stats[type].bytes, cpu);
+        }
+        seq_printf(m, "%-16s %10ld %12ld\n", vwifi_mem_names[type], sum.objs,
+                   sum.bytes);
+        total.objs += sum.objs;
+        total.bytes += sum.bytes;
+    }
+    seq_printf(m, "%-16s %10ld %12ld\n", "total", total.objs, total.bytes);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vwifi_memory);
+
+/* Time spent in each phase of vwifi_init() */
+static int vwifi_init_timings_show(struct seq_file *m, void *v)
+{
+    u64 total = 0;
+
+    seq_printf(m, "%-16s %12s\n", "phase", "us");
+    for (int i = 0; i < VWIFI_INIT_PHASES; i++) {
+        seq_printf(m, "%-16s %12llu\n", vwifi_init_names[i],
+                   div_u64(vwifi_init_ns[i], NSEC_PER_USEC));
+        total += vwifi_init_ns[i];
+    }
+    seq_printf(m, "%-16s %12llu\n", "total", div_u64(total, NSEC_PER_USEC));
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vwifi_init_timings);
+
+/* Positions of the vifs. Writing "<ifname> <x> <y>" moves a vif. */
+static int vwifi_positions_show(struct seq_file *m, void *v)
+{
+    struct vwifi_vif *vif;
+
+    seq_printf(m, "%-16s %11s %11s\n", "ifname", "x", "y");
+
+    spin_lock_bh(&vif_list_lock);
+    list_for_each_entry (vif, &vwifi->vif_list, list) {
+        spin_lock(&vwifi_grid_lock);
+        seq_printf(m, "%-16s %11d %11d\n", vif->ndev->name, vif->pos_x,
+                   vif->pos_y);
+        spin_unlock(&vwifi_grid_lock);
+    }
+    spin_unlock_bh(&vif_list_lock);
+
+    return 0;
+}
+
+static int vwifi_positions_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vwifi_positions_show, inode->i_private);
+}
+
+static ssize_t vwifi_positions_write(struct file *file,
+                                     const char __user *ubuf,
+                                     size_t count,
+                                     loff_t *ppos)
+{
+    char buf[64], name[IFNAMSIZ];
+    struct vwifi_vif *vif;
+    ssize_t ret = -ENODEV;
+    s32 x, y;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if (sscanf(buf, "%15s %d %d", name, &x, &y) != 3)
+        return -EINVAL;
+
+    spin_lock_bh(&vif_list_lock);
+    list_for_each_entry (vif, &vwifi->vif_list, list) {
+        if (strcmp(vif->ndev->name, name))
+            continue;
+
+        vwifi_grid_move(vif, x, y);
+        ret = count;
+        break;
+    }
+    spin_unlock_bh(&vif_list_lock);
+
+    /* The moved vif may now be within range of parked APs */
+    if (ret > 0)
+        vwifi_beacon_wake();
+
+    return ret;
+}
+
+static const struct file_operations vwifi_positions_fops = {
+    .owner = THIS_MODULE,
+    .open = vwifi_positions_open,
+    .read = seq_read,
+    .write = vwifi_positions_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* Lightweight STAs. Writing "add <ap> <count> [<model> <rate> <len> [<on_ms>
+ * <off_ms>]]" associates new ones to the AP interface <ap>, and "del <ap>"
+ * removes all of them.
+ */
+static int vwifi_lite_stations_show(struct seq_file *m, void *v)
+{
+    struct vwifi_lsta *lsta;
+    int bkt;
+
+    seq_printf(m, "%-17s %-16s %-8s %10s %12s %10s %12s\n", "mac", "ap",
+               "model", "tx_packets", "tx_bytes", "rx_packets", "rx_bytes");
+
+    spin_lock_bh(&vwifi_lsta_lock);
+    hash_for_each (vwifi_lsta_table, bkt, lsta, node) {
+        struct vwifi_vif *ap = lsta->ap;
+
+        seq_printf(m, "%pM %-16s %-8s %10llu %12llu %10llu %12llu\n",
+                   lsta->mac, ap->ndev->name, vwifi_lsta_models[lsta->model],
+                   lsta->tx_packets, lsta->tx_bytes,
+                   lsta->rx_packets + ap->lsta_bcast - lsta->bcast_base,
+                   lsta->rx_bytes + ap->lsta_bcast_bytes -
+                       lsta->bcast_bytes_base);
+    }
+    spin_unlock_bh(&vwifi_lsta_lock);
+
+    return 0;
+}
+
+static int vwifi_lite_stations_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vwifi_lite_stations_show, inode->i_private);
+}
+
+static ssize_t vwifi_lite_stations_write(struct file *file,
+                                         const char __user *ubuf,
+                                         size_t count,
+                                         loff_t *ppos)
+{
+    char buf[128], cmd[8], name[IFNAMSIZ], model[16] = "idle";
+    struct vwifi_lsta tmpl = {.len = ETH_ZLEN};
+    struct vwifi_vif *ap;
+    unsigned int n = 0;
+    unsigned long flags;
+    ssize_t ret = -ENODEV;
+    int args;
+
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    args = sscanf(buf, "%7s %15s %u %15s %u %u %u %u", cmd, name, &n, model,
+                  &tmpl.rate, &tmpl.len, &tmpl.on_ms, &tmpl.off_ms);
+    if (args < 2)
+        return -EINVAL;
+
+    if (!strcmp(cmd, "add")) {
+        int m = match_string(vwifi_lsta_models, ARRAY_SIZE(vwifi_lsta_models),
+                             model);
+
+        if (args < 3 || !n || n > (1 << 16) || m < 0)
+            return -EINVAL;
+        tmpl.model = m;
+        if (tmpl.model != VWIFI_LSTA_IDLE &&
+            (args < 6 || !tmpl.rate || tmpl.rate > USEC_PER_SEC ||
+             tmpl.len < ETH_ZLEN || tmpl.len > ETH_DATA_LEN))
+            return -EINVAL;
+        if (tmpl.model == VWIFI_LSTA_ONOFF &&
+            (args < 8 || !tmpl.on_ms || !tmpl.off_ms))
+            return -EINVAL;
+    } else if (strcmp(cmd, "del")) {
+        return -EINVAL;
+    }
+
+    /* The STAs of the other guests are not emulated here */
+    spin_lock_irqsave(&vwifi_virtio_lock, flags);
+    if (vwifi_virtio_enabled) {
+        spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+        return -EOPNOTSUPP;
+    }
+    spin_unlock_irqrestore(&vwifi_virtio_lock, flags);
+
+    /* Held so that the AP does not stop meanwhile, vwifi_lsta_add() drops it
+     * between batches
+     */
+    mutex_lock(&vwifi->lock);
+    list_for_each_entry (ap, &vwifi->ap_list, ap_list) {
+        if (!ap->ap_enabled || strcmp(ap->ndev->name, name))
+            continue;
+
+        if (!strcmp(cmd, "add")) {
+            ret = vwifi_lsta_add(ap, n, &tmpl);
+        } else {
+            vwifi_lsta_flush(ap);
+            ret = 0;
+        }
+        if (!ret)
+            ret = count;
+        break;
+    }
+    mutex_unlock(&vwifi->lock);
+
+    return ret;
+}
+
+static const struct file_operations vwifi_lite_stations_fops = {
+    .owner = THIS_MODULE,
+    .open = vwifi_lite_stations_open,
+    .read = seq_read,
+    .write = vwifi_lite_stations_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void vwifi_debugfs_init(void)
+{
+    vwifi_debugfs = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+    debugfs_create_file("proxy_neigh", 0644, vwifi_debugfs, NULL,
+                        &vwifi_proxy_neigh_fops);
+    debugfs_create_file("mcast_groups", 0444, vwifi_debugfs, NULL,
+                        &vwifi_mcast_groups_fops);
+    debugfs_create_file("memory", 0444, vwifi_debugfs, NULL,
+                        &vwifi_memory_fops);
+    debugfs_create_file("init_timings", 0444, vwifi_debugfs, NULL,
+                        &vwifi_init_timings_fops);
+    debugfs_create_file("positions", 0644, vwifi_debugfs, NULL,
+                        &vwifi_positions_fops);
+    debugfs_create_file("lite_stations", 0644, vwifi_debugfs, NULL,
+                        &vwifi_lite_stations_fops);
+}
+
 static int __init vwifi_init(void)
 {
+    u64 start;
     int err;
 
     vwifi = kmalloc(sizeof(struct vwifi_context), GFP_KERNEL);
@@ -3098,12 +7794,15 @@ static int __init vwifi_init(void)
     INIT_LIST_HEAD(&vwifi->ap_list);
     vwifi->denylist = kmalloc(sizeof(char) * MAX_DENYLIST_SIZE, GFP_KERNEL);
 
+    start = ktime_get_ns();
     for (int i = 0; i < station; i++) {
         struct wiphy *wiphy = vwifi_cfg80211_add();
         if (!wiphy)
             goto cfg80211_add;
+        vwifi_phase_end(&vwifi_init_ns[VWIFI_INIT_WIPHY], &start);
         if (!vwifi_interface_add(wiphy, i))
             goto interface_add;
+        vwifi_phase_end(&vwifi_init_ns[VWIFI_INIT_NETDEV], &start);
     }
 
     nl_sk = netlink_kernel_create(&init_net, NETLINK_USERSOCK, &nl_config);
@@ -3111,15 +7810,26 @@ static int __init vwifi_init(void)
         pr_info("Error creating netlink socket\n");
         goto cfg80211_add;
     }
+    vwifi_phase_end(&vwifi_init_ns[VWIFI_INIT_NETLINK], &start);
 
     err = register_virtio_driver(&virtio_vwifi);
     if (err)
         goto err_register_virtio_driver;
+    vwifi_phase_end(&vwifi_init_ns[VWIFI_INIT_VIRTIO], &start);
+
+    err = misc_register(&vwifi_medium_dev);
+    if (err)
+        goto err_misc_register;
+
+    vwifi_debugfs_init();
+    vwifi_phase_end(&vwifi_init_ns[VWIFI_INIT_MEDIUM], &start);
 
     vwifi->state = VWIFI_READY;
 
     return 0;
 
+err_misc_register:
+    unregister_virtio_driver(&virtio_vwifi);
 err_register_virtio_driver:
 interface_add:
     /* FIXME: check for resource deallocation */
@@ -3131,11 +7841,35 @@ cfg80211_add:
 
 static void __exit vwifi_exit(void)
 {
+    u64 t = ktime_get_ns(), total = 0;
+    unsigned int n;
+
     vwifi->state = VWIFI_SHUTDOWN;
+    /* Walk the APs, which are about to go away */
+    cancel_delayed_work_sync(&vwifi_inactivity_dwork);
+    cancel_delayed_work_sync(&vwifi_lsta_dwork);
 
+    debugfs_remove_recursive(vwifi_debugfs);
+    misc_deregister(&vwifi_medium_dev);
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_WORK], &t);
     unregister_virtio_driver(&virtio_vwifi);
-    vwifi_free();
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_VIRTIO], &t);
+    /* Times its own phases */
+    n = vwifi_free();
+    t = ktime_get_ns();
+    /* Every scan was stopped when its interface went away */
+    cancel_delayed_work_sync(&vwifi_scan_batch_dwork);
+    cancel_delayed_work_sync(&vwifi_sched_scan_dwork);
     netlink_kernel_release(nl_sk);
+    vwifi_phase_end(&vwifi_exit_ns[VWIFI_EXIT_NETLINK], &t);
+
+    for (int i = 0; i < VWIFI_EXIT_PHASES; i++)
+        total += vwifi_exit_ns[i];
+    pr_info("vwifi: %u interfaces removed in %llu ms\n", n,
+            div_u64(total, NSEC_PER_MSEC));
+    for (int i = 0; i < VWIFI_EXIT_PHASES; i++)
+        pr_info("vwifi: exit phase %s %llu us\n", vwifi_exit_names[i],
+                div_u64(vwifi_exit_ns[i], NSEC_PER_USEC));
 }
 
 module_init(vwifi_init);